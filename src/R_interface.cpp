@@ -3,128 +3,140 @@
 
 #include "R_interface.h"
 
-static ScaleHMM* hmm; // declare as static outside the function because we only need one and this enables memory-cleanup on R_CheckUserInterrupt()
-static double** multiD;
-
 // ===================================================================================================================================================
-// This function takes parameters from R, creates a univariate HMM object, creates the distributions, runs the EM and returns the result to R.
+// The number of threads is set for the calling thread and restored on return, so that other packages in the same R session keep their own setting.
+// Without OpenMP the code runs serially and the number of threads is ignored.
 // ===================================================================================================================================================
-void univariate_hmm(int* O, int* T, int* N, int* state_labels, double* size, double* prob, int* maxiter, int* maxtime, double* eps, int* states, double* A, double* proba, double* loglik, double* weights, int* distr_type, double* initial_size, double* initial_prob, double* initial_A, double* initial_proba, bool* use_initial_params, int* num_threads, int* error, int* read_cutoff, int* algorithm)
+static int set_num_threads(int num_threads)
 {
-
-	// Define logging level
-// 	FILE* pFile = fopen("chromStar.log", "w");
-// 	Output2FILE::Stream() = pFile;
-//  	FILELog::ReportingLevel() = FILELog::FromString("NONE");
-//  	FILELog::ReportingLevel() = FILELog::FromString("DEBUG2");
-
-// 	// Parallelization settings
-// 	omp_set_num_threads(*num_threads);
-
-	// Print some information
-	//FILE_LOG(logINFO) << "number of states = " << *N;
-	Rprintf("number of states = %d\n", *N);
-	//FILE_LOG(logINFO) << "number of bins = " << *T;
-	Rprintf("number of bins = %d\n", *T);
-	if (*maxiter < 0)
+#ifdef _OPENMP
+	int previous = omp_get_max_threads();
+	if (num_threads > 0)
 	{
-		//FILE_LOG(logINFO) << "maximum number of iterations = none";
-		Rprintf("maximum number of iterations = none\n");
-	} else {
-		//FILE_LOG(logINFO) << "maximum number of iterations = " << *maxiter;
-		Rprintf("maximum number of iterations = %d\n", *maxiter);
+		omp_set_num_threads(num_threads);
 	}
-	if (*maxtime < 0)
+	return(previous);
+#else
+	(void)num_threads;
+	return(1);
+#endif
+}
+
+// ===================================================================================================================================================
+// R_CheckUserInterrupt() does not return if the user interrupts. Each call therefore registers its HMM as a protected external pointer: on a regular
+// return it is freed directly, after an interrupt the protection is released and the finalizer frees it with the next garbage collection.
+// ===================================================================================================================================================
+static void finalize_hmm(SEXP ptr)
+{
+	ScaleHMM* hmm = (ScaleHMM*) R_ExternalPtrAddr(ptr);
+	if (hmm != NULL)
 	{
-		//FILE_LOG(logINFO) << "maximum running time = none";
-		Rprintf("maximum running time = none\n");
-	} else {
-		//FILE_LOG(logINFO) << "maximum running time = " << *maxtime << " sec";
-		Rprintf("maximum running time = %d sec\n", *maxtime);
+		delete hmm;
+		R_ClearExternalPtr(ptr);
 	}
-	//FILE_LOG(logINFO) << "epsilon = " << *eps;
-	Rprintf("epsilon = %g\n", *eps);
+}
 
-	//FILE_LOG(logDEBUG3) << "observation vector";
-	for (int t=0; t<50; t++) {
-		//FILE_LOG(logDEBUG3) << "O["<<t<<"] = " << O[t];
+// ===================================================================================================================================================
+// Building blocks of the univariate fit. They only call the R API if verbose, so that univariate_hmm_batch() can use them on worker threads.
+// ===================================================================================================================================================
+// lxfactorials can be shared between HMMs on the same observations, NULL lets each density compute its own
+static NegativeBinomial* new_negative_binomial(int* O, int T, double size, double prob, int max_obs, double* lxfactorials)
+{
+	if (lxfactorials == NULL)
+	{
+		return(new NegativeBinomial(O, T, size, prob));
 	}
+	return(new NegativeBinomial(O, T, size, prob, max_obs, lxfactorials));
+}
 
-	// Flush Rprintf statements to console
-	R_FlushConsole();
+static ZiNB* new_zinb(int* O, int T, double size, double prob, double w, int max_obs, double* lxfactorials)
+{
+	if (lxfactorials == NULL)
+	{
+		return(new ZiNB(O, T, size, prob, w));
+	}
+	return(new ZiNB(O, T, size, prob, w, max_obs, lxfactorials));
+}
 
-	// Create the HMM
-	//FILE_LOG(logDEBUG1) << "Creating a univariate HMM";
-	hmm = new ScaleHMM(*T, *N);
-// 	LogHMM* hmm = new LogHMM(*T, *N);
-	hmm->set_cutoff(*read_cutoff);
-	// Initialize the transition probabilities and proba
-	hmm->initialize_transition_probs(initial_A, *use_initial_params);
-	hmm->initialize_proba(initial_proba, *use_initial_params);
-    
-	// Calculate mean and variance of data
-	double mean = 0, variance = 0;
-	for(int t=0; t<*T; t++)
+static ScaleHMM* create_univariate_hmm(int* O, int T, int N, int* distr_type, double* initial_size, double* initial_prob, double* initial_w, double* initial_A, double* initial_proba, bool use_initial_params, int read_cutoff, int memory_mode, int num_segments, int* segment_starts, int max_obs, double* lxfactorials)
+{
+	ScaleHMM* hmm;
+	if (memory_mode == 2)
 	{
-		mean+= O[t];
+		hmm = new ScaleHMM(O, T, N, TIME_MAJOR, MEMORY_LOW);
 	}
-	mean = mean / *T;
-	for(int t=0; t<*T; t++)
+	else
 	{
-		variance+= pow(O[t] - mean, 2);
+		hmm = new ScaleHMM(O, T, N);
 	}
-	variance = variance / *T;
-	//FILE_LOG(logINFO) << "data mean = " << mean << ", data variance = " << variance;		
-	Rprintf("data mean = %g, data variance = %g\n", mean, variance);		
-	
+// 	LogHMM* hmm = new LogHMM(T, N);
+	hmm->set_cutoff(read_cutoff);
+	hmm->set_segments(num_segments, segment_starts);
+	// Initialize the transition probabilities and proba
+	hmm->initialize_transition_probs(initial_A, use_initial_params);
+	hmm->initialize_proba(initial_proba, use_initial_params);
+
 	// Create the emission densities and initialize
-	for (int i_state=0; i_state<*N; i_state++)
+	for (int i_state=0; i_state<N; i_state++)
 	{
 		if (distr_type[i_state] == 1)
 		{
 			//FILE_LOG(logDEBUG1) << "Using delta distribution for state " << i_state;
-			ZeroInflation *d = new ZeroInflation(O, *T); // delete is done inside ~ScaleHMM()
+			ZeroInflation *d = new ZeroInflation(O, T); // delete is done inside ~ScaleHMM()
 			hmm->densityFunctions.push_back(d);
 		}
 		else if (distr_type[i_state] == 2)
 		{
 			//FILE_LOG(logDEBUG1) << "Using geometric distribution for state " << i_state;
-			Geometric *d = new Geometric(O, *T, initial_prob[i_state]); // delete is done inside ~ScaleHMM()
+			Geometric *d = new Geometric(O, T, initial_prob[i_state]); // delete is done inside ~ScaleHMM()
 			hmm->densityFunctions.push_back(d);
 		}
 		else if (distr_type[i_state] == 3)
 		{
 			//FILE_LOG(logDEBUG1) << "Using negative binomial for state " << i_state;
-			NegativeBinomial *d = new NegativeBinomial(O, *T, initial_size[i_state], initial_prob[i_state]); // delete is done inside ~ScaleHMM()
+			NegativeBinomial *d = new_negative_binomial(O, T, initial_size[i_state], initial_prob[i_state], max_obs, lxfactorials); // delete is done inside ~ScaleHMM()
 			hmm->densityFunctions.push_back(d);
 		}
 		else if (distr_type[i_state] == 4)
 		{
 			//FILE_LOG(logDEBUG1) << "Using binomial for state " << i_state;
-			NegativeBinomial *d = new NegativeBinomial(O, *T, initial_size[i_state], initial_prob[i_state]); // delete is done inside ~ScaleHMM()
+			NegativeBinomial *d = new_negative_binomial(O, T, initial_size[i_state], initial_prob[i_state], max_obs, lxfactorials); // delete is done inside ~ScaleHMM()
+			hmm->densityFunctions.push_back(d);
+		}
+		else if (distr_type[i_state] == 5)
+		{
+			//FILE_LOG(logDEBUG1) << "Using zero-inflated negative binomial for state " << i_state;
+			ZiNB *d = new_zinb(O, T, initial_size[i_state], initial_prob[i_state], initial_w[i_state], max_obs, lxfactorials); // delete is done inside ~ScaleHMM()
 			hmm->densityFunctions.push_back(d);
 		}
 		else
 		{
 			//FILE_LOG(logWARNING) << "Density not specified, using default negative binomial for state " << i_state;
-			NegativeBinomial *d = new NegativeBinomial(O, *T, initial_size[i_state], initial_prob[i_state]);
+			NegativeBinomial *d = new_negative_binomial(O, T, initial_size[i_state], initial_prob[i_state], max_obs, lxfactorials);
 			hmm->densityFunctions.push_back(d);
 		}
 	}
+	return(hmm);
+}
 
-	// Flush Rprintf statements to console
-	R_FlushConsole();
-
-	// Do the EM to estimate the parameters
+static void run_hmm(ScaleHMM* hmm, int* maxiter, int* maxtime, double* eps, int algorithm, int* error, bool verbose)
+{
 	try
 	{
-		if (*algorithm == 1)
+		if (algorithm == 1)
 		{
 			hmm->baumWelch();
 		}
-		else if (*algorithm == 3)
+		else if (algorithm == 2)
+		{
+			// Decoding with fixed parameters, without forward-backward
+			hmm->viterbi();
+		}
+		else if (algorithm == 3 || algorithm == 4)
 		{
 			//FILE_LOG(logDEBUG1) << "Starting EM estimation";
+			// Algorithm 4 is the EM with SQUAREM acceleration
+			hmm->set_acceleration(algorithm == 4);
 			hmm->EM(maxiter, maxtime, eps);
 			//FILE_LOG(logDEBUG1) << "Finished with EM estimation";
 		}
@@ -132,50 +144,60 @@ void univariate_hmm(int* O, int* T, int* N, int* state_labels, double* size, dou
 	catch (std::exception& e)
 	{
 		//FILE_LOG(logERROR) << "Error in EM/baumWelch: " << e.what();
-		Rprintf("Error in EM/baumWelch: %s\n", e.what());
+		if (verbose) { Rprintf("Error in EM/baumWelch: %s\n", e.what()); }
 		if (strcmp(e.what(),"nan detected")==0) { *error = 1; }
 		else { *error = 2; }
 	}
+}
 
-// 	// Compute the posteriors and save results directly to the R pointer
-// 	//FILE_LOG(logDEBUG1) << "Recode posteriors into column representation";
-// 	#pragma omp parallel for
-// 	for (int iN=0; iN<*N; iN++)
-// 	{
-// 		for (int t=0; t<*T; t++)
-// 		{
-// 			posteriors[t + iN * (*T)] = hmm->get_posterior(iN, t);
-// 		}
-// 	}
-
-	// Compute the states from posteriors
-	//FILE_LOG(logDEBUG1) << "Computing states from posteriors";
-	int ind_max;
-	std::vector<double> posterior_per_t(*N);
-	for (int t=0; t<*T; t++)
+static void get_univariate_results(ScaleHMM* hmm, int T, int N, int* state_labels, int* states, double* size, double* prob, double* w, double* A, double* proba, double* loglik, double* weights, int algorithm)
+{
+	if (algorithm == 2)
 	{
-		for (int iN=0; iN<*N; iN++)
+		// States from the Viterbi path, the weights are the fractions of time points in each state
+		for (int iN=0; iN<N; iN++)
 		{
-			posterior_per_t[iN] = hmm->get_posterior(iN, t);
+			weights[iN] = 0;
+		}
+		for (int t=0; t<T; t++)
+		{
+			int iN = hmm->get_viterbi_state(t);
+			states[t] = state_labels[iN];
+			weights[iN] += 1.0 / T;
+		}
+	}
+	else
+	{
+		// Compute the states from posteriors
+		//FILE_LOG(logDEBUG1) << "Computing states from posteriors";
+		int ind_max;
+		std::vector<double> posterior_per_t(N);
+		for (int t=0; t<T; t++)
+		{
+			for (int iN=0; iN<N; iN++)
+			{
+				posterior_per_t[iN] = hmm->get_posterior(iN, t);
+			}
+			ind_max = std::distance(posterior_per_t.begin(), std::max_element(posterior_per_t.begin(), posterior_per_t.end()));
+			states[t] = state_labels[ind_max];
 		}
-		ind_max = std::distance(posterior_per_t.begin(), std::max_element(posterior_per_t.begin(), posterior_per_t.end()));
-		states[t] = state_labels[ind_max];
 	}
 
 	//FILE_LOG(logDEBUG1) << "Return parameters";
 	// also return the estimated transition matrix and the initial probs
-	for (int i=0; i<*N; i++)
+	for (int i=0; i<N; i++)
 	{
 		proba[i] = hmm->get_proba(i);
-		for (int j=0; j<*N; j++)
+		for (int j=0; j<N; j++)
 		{
-			A[i * (*N) + j] = hmm->get_A(j,i);
+			A[i * N + j] = hmm->get_A(j,i);
 		}
 	}
 
 	// copy the estimated distribution params
-	for (int i=0; i<*N; i++)
+	for (int i=0; i<N; i++)
 	{
+		w[i] = 0;
 		if (hmm->densityFunctions[i]->get_name() == NEGATIVE_BINOMIAL) 
 		{
 			NegativeBinomial* d = (NegativeBinomial*)(hmm->densityFunctions[i]);
@@ -194,6 +216,13 @@ void univariate_hmm(int* O, int* T, int* N, int* state_labels, double* size, dou
 			size[i] = 0;
 			prob[i] = 1;
 		}
+		else if (hmm->densityFunctions[i]->get_name() == ZERO_INFLATED_NEGATIVE_BINOMIAL)
+		{
+			ZiNB* d = (ZiNB*)(hmm->densityFunctions[i]);
+			size[i] = d->get_size();
+			prob[i] = d->get_prob();
+			w[i] = d->get_w();
+		}
 		else if (hmm->densityFunctions[i]->get_name() == BINOMIAL) 
 		{
 			Binomial* d = (Binomial*)(hmm->densityFunctions[i]);
@@ -201,19 +230,699 @@ void univariate_hmm(int* O, int* T, int* N, int* state_labels, double* size, dou
 			prob[i] = d->get_prob();
 		}
 	}
-	*loglik = hmm->get_logP();
-	hmm->calc_weights(weights);
+	if (algorithm == 2)
+	{
+		*loglik = hmm->get_viterbi_logP();
+	}
+	else
+	{
+		*loglik = hmm->get_logP();
+		hmm->calc_weights(weights);
+	}
+}
+
+// ===================================================================================================================================================
+// This function takes parameters from R, creates a univariate HMM object, creates the distributions, runs the EM and returns the result to R.
+// ===================================================================================================================================================
+void univariate_hmm(int* O, int* T, int* N, int* state_labels, double* size, double* prob, int* maxiter, int* maxtime, double* eps, int* states, double* A, double* proba, double* loglik, double* weights, int* distr_type, double* initial_size, double* initial_prob, double* initial_A, double* initial_proba, bool* use_initial_params, int* num_threads, int* error, int* read_cutoff, int* algorithm, int* memory_mode, int* num_segments, int* segment_starts, double* w, double* initial_w, int* posterior_diff)
+{
+
+	// Define logging level
+// 	FILE* pFile = fopen("chromStar.log", "w");
+// 	Output2FILE::Stream() = pFile;
+//  	FILELog::ReportingLevel() = FILELog::FromString("NONE");
+//  	FILELog::ReportingLevel() = FILELog::FromString("DEBUG2");
+
+	// Parallelization settings
+	int previous_num_threads = set_num_threads(*num_threads);
+
+	// Print some information
+	//FILE_LOG(logINFO) << "number of states = " << *N;
+	Rprintf("number of states = %d\n", *N);
+	//FILE_LOG(logINFO) << "number of bins = " << *T;
+	Rprintf("number of bins = %d\n", *T);
+	//FILE_LOG(logINFO) << "number of segments = " << *num_segments;
+	Rprintf("number of segments = %d\n", *num_segments);
+	if (*maxiter < 0)
+	{
+		//FILE_LOG(logINFO) << "maximum number of iterations = none";
+		Rprintf("maximum number of iterations = none\n");
+	} else {
+		//FILE_LOG(logINFO) << "maximum number of iterations = " << *maxiter;
+		Rprintf("maximum number of iterations = %d\n", *maxiter);
+	}
+	if (*maxtime < 0)
+	{
+		//FILE_LOG(logINFO) << "maximum running time = none";
+		Rprintf("maximum running time = none\n");
+	} else {
+		//FILE_LOG(logINFO) << "maximum running time = " << *maxtime << " sec";
+		Rprintf("maximum running time = %d sec\n", *maxtime);
+	}
+	//FILE_LOG(logINFO) << "epsilon = " << *eps;
+	Rprintf("epsilon = %g\n", *eps);
+
+	//FILE_LOG(logDEBUG3) << "observation vector";
+	for (int t=0; t<50; t++) {
+		//FILE_LOG(logDEBUG3) << "O["<<t<<"] = " << O[t];
+	}
+
+	// Calculate mean and variance of data
+	double mean = 0, variance = 0;
+	for(int t=0; t<*T; t++)
+	{
+		mean+= O[t];
+	}
+	mean = mean / *T;
+	for(int t=0; t<*T; t++)
+	{
+		variance+= pow(O[t] - mean, 2);
+	}
+	variance = variance / *T;
+	//FILE_LOG(logINFO) << "data mean = " << mean << ", data variance = " << variance;		
+	Rprintf("data mean = %g, data variance = %g\n", mean, variance);		
+	if (*memory_mode == 2)
+	{
+		//FILE_LOG(logINFO) << "memory mode = low";
+		Rprintf("memory mode = low\n");
+	}
+
+	// Flush Rprintf statements to console
+	R_FlushConsole();
+
+	// Create the HMM
+	//FILE_LOG(logDEBUG1) << "Creating a univariate HMM";
+	ScaleHMM* hmm = create_univariate_hmm(O, *T, *N, distr_type, initial_size, initial_prob, initial_w, initial_A, initial_proba, *use_initial_params, *read_cutoff, *memory_mode, *num_segments, segment_starts, 0, NULL);
+	SEXP hmm_ptr = PROTECT(R_MakeExternalPtr(hmm, R_NilValue, R_NilValue));
+	R_RegisterCFinalizerEx(hmm_ptr, finalize_hmm, TRUE);
+	hmm->set_posterior_diff(*posterior_diff != 0);
+
+	// Do the EM to estimate the parameters
+	run_hmm(hmm, maxiter, maxtime, eps, *algorithm, error, true);
+
+	// Compute the states and copy the parameters
+	get_univariate_results(hmm, *T, *N, state_labels, states, size, prob, w, A, proba, loglik, weights, *algorithm);
 	
 	//FILE_LOG(logDEBUG1) << "Deleting the hmm";
 	delete hmm;
-	hmm = NULL; // assign NULL to defuse the additional delete in on.exit() call
+	R_ClearExternalPtr(hmm_ptr);
+	UNPROTECT(1);
+	set_num_threads(previous_num_threads);
+}
+
+
+// =====================================================================================================================================================
+// This function fits a batch of univariate HMMs (e.g. one per cell) in parallel. Each element of 'jobs' is a named list with the arguments of one fit.
+// Jobs are started from the largest to the smallest and handed out one at a time, so that threads that finish early pick up the remaining jobs.
+// A job can contain several sets of initial parameters (trials), which share the observations and the table of log(x!). The trials are fitted
+// together in rounds of doubling iteration budgets, trials that are clearly behind are dropped after each round (successive halving), and the
+// remaining trial that is selected as in univariate.findCNVs() is returned.
+// =====================================================================================================================================================
+struct UnivariateJob
+{
+	// Input
+	int* O;
+	int T;
+	int N;
+	int* state_labels;
+	int* distr_type;
+	double* initial_size; ///< vector [N x num_trials]
+	double* initial_prob; ///< vector [N x num_trials]
+	double* initial_w; ///< vector [N x num_trials]
+	double* initial_A; ///< vector [N x N x num_trials]
+	double* initial_proba; ///< vector [N x num_trials]
+	int num_trials;
+	int most_frequent_state; ///< index of the state that is assumed to be the most frequent one, used to select among trials
+	int read_cutoff;
+	int algorithm;
+	int memory_mode;
+	int num_segments;
+	int* segment_starts;
+	bool posterior_diff; ///< compute the difference in posteriors between the last two Baum-Welch runs (for debugging)
+	// Output
+	int* states;
+	double* size;
+	double* prob;
+	double* w;
+	double* A;
+	double* proba;
+	double* loglik;
+	double* weights;
+	int* num_iterations; ///< maximum number of iterations on input
+	int* time_sec; ///< maximum running time on input
+	double* loglik_delta; ///< convergence threshold on input
+	int* error;
+	double* trial_loglik; ///< vector [num_trials] of log-likelihoods of the trials
+	double* trial_loglik_delta; ///< vector [num_trials] of the last change in log-likelihood of the trials
+	int* trial_num_iterations; ///< vector [num_trials] of iterations of the trials
+	int* trial_pruned; ///< vector [num_trials], 1 if the trial was dropped before convergence
+	int* trial_selected; ///< index of the selected trial (1-based)
+	double* posterior_diff_sum; ///< difference in posteriors of the selected trial, NA if not posterior_diff
+};
+
+static SEXP get_list_element(SEXP list, const char* name)
+{
+	SEXP names = Rf_getAttrib(list, R_NamesSymbol);
+	for (int i=0; i<Rf_length(list); i++)
+	{
+		if (strcmp(CHAR(STRING_ELT(names, i)), name) == 0)
+		{
+			return(VECTOR_ELT(list, i));
+		}
+	}
+	Rf_error("element '%s' is missing in HMM job", name);
+	return(R_NilValue);
+}
+
+static bool larger_job(const UnivariateJob* a, const UnivariateJob* b)
+{
+	return((double)a->T * a->N * a->N * a->num_trials > (double)b->T * b->N * b->N * b->num_trials);
+}
+
+// Successive halving settings for the trials
+#define TRIALS_FIRST_ROUND 10 ///< iterations of the first round, doubled in every further round
+#define TRIALS_PRUNE_MARGIN 1e-3 ///< a trial is clearly behind if its log-likelihood is lower than that of the leader by this fraction
+
+enum TrialStatus {TRIAL_RUNNING, TRIAL_DONE, TRIAL_PRUNED, TRIAL_FAILED};
+
+struct TrialRank
+{
+	int index;
+	bool most_frequent; ///< weight of the most frequent state is at least half of the maximum weight
+	double loglik;
+};
+
+// Mathematically we should select the fit with highest loglikelihood. If we think the fit with the highest loglikelihood is incorrect, we should change the underlying model.
+// However, this is very complex and we choose to select a fit that we think is (more) correct, although it has not the highest support given our (imperfect) model:
+// Trials where the most frequent state has at least half of the maximum weight come first, then higher log-likelihood
+static bool better_trial(const TrialRank& a, const TrialRank& b)
+{
+	if (a.most_frequent != b.most_frequent)
+	{
+		return(a.most_frequent);
+	}
+	return(a.loglik > b.loglik);
+}
+
+static TrialRank rank_trial(ScaleHMM* hmm, int index, int N, int most_frequent_state)
+{
+	TrialRank rank;
+	rank.index = index;
+	rank.loglik = hmm->get_logP();
+	if (std::isnan(rank.loglik))
+	{
+		rank.loglik = -INFINITY;
+	}
+	std::vector<double> weights(N);
+	hmm->calc_weights(&weights[0]);
+	double max_weight = *std::max_element(weights.begin(), weights.end());
+	rank.most_frequent = weights[most_frequent_state] / max_weight > 0.5;
+	return(rank);
+}
+
+// Owns the HMMs of the trials, so that they are freed if create_univariate_hmm() or get_univariate_results() throws
+struct TrialHMMs
+{
+	std::vector<ScaleHMM*> hmm;
+	TrialHMMs(int num_trials) : hmm(num_trials, (ScaleHMM*) NULL) {}
+	~TrialHMMs()
+	{
+		for (size_t i=0; i<this->hmm.size(); i++)
+		{
+			delete this->hmm[i];
+		}
+	}
+};
+
+static void run_univariate_trials(UnivariateJob& j, int num_threads)
+{
+	int N = j.N;
+	int num_trials = j.num_trials;
+
+	// Shared table of log(x!)
+	int max_obs = intMax(j.O, j.T);
+	std::vector<double> lxfactorials(max_obs+1, 0.0);
+	for (int x=2; x<=max_obs; x++)
+	{
+		lxfactorials[x] = lxfactorials[x-1] + log(x);
+	}
+
+	TrialHMMs trials(num_trials);
+	std::vector<ScaleHMM*>& hmm = trials.hmm;
+	std::vector<int> status(num_trials, TRIAL_RUNNING);
+	std::vector<int> error(num_trials, 0);
+	std::vector<int> time_sec(num_trials, 0);
+	for (int i=0; i<num_trials; i++)
+	{
+		hmm[i] = create_univariate_hmm(j.O, j.T, N, j.distr_type, j.initial_size + i*N, j.initial_prob + i*N, j.initial_w + i*N, j.initial_A + i*N*N, j.initial_proba + i*N, true, j.read_cutoff, j.memory_mode, j.num_segments, j.segment_starts, max_obs, &lxfactorials[0]);
+		hmm[i]->set_quiet(true);
+		hmm[i]->set_interruptible(false);
+		hmm[i]->set_posterior_diff(j.posterior_diff);
+		// With several trials the EM runs in rounds, SQUAREM extrapolates as in a single run up to the maximum number of iterations
+		if (num_trials > 1)
+		{
+			hmm[i]->set_iteration_limit(*j.num_iterations);
+		}
+		j.trial_loglik[i] = -INFINITY;
+		j.trial_loglik_delta[i] = INFINITY;
+		j.trial_num_iterations[i] = 0;
+		j.trial_pruned[i] = 0;
+	}
+
+	int budget = TRIALS_FIRST_ROUND;
+	for (int round=0; ; round++)
+	{
+		// With a single running trial the team has one thread and the segments inside the trial run in parallel
+		int round_threads = 0;
+		for (int i=0; i<num_trials; i++)
+		{
+			if (status[i] == TRIAL_RUNNING) round_threads++;
+		}
+		round_threads = std::min(round_threads, num_threads);
+		#pragma omp parallel for schedule(dynamic,1) num_threads(round_threads)
+		for (int i=0; i<num_trials; i++)
+		{
+			if (status[i] != TRIAL_RUNNING) continue;
+			// A single trial runs without rounds
+			int maxiter = *j.num_iterations;
+			if (num_trials > 1 && (j.algorithm == 3 || j.algorithm == 4) && (maxiter < 0 || budget < maxiter))
+			{
+				maxiter = budget;
+			}
+			int maxtime = *j.time_sec;
+			double eps = *j.loglik_delta;
+			try
+			{
+				if (round == 0)
+				{
+					run_hmm(hmm[i], &maxiter, &maxtime, &eps, j.algorithm, &error[i], false);
+				}
+				else
+				{
+					hmm[i]->resume_EM(&maxiter, &maxtime, &eps);
+				}
+			}
+			catch (std::exception& e)
+			{
+				if (strcmp(e.what(),"nan detected")==0) { error[i] = 1; }
+				else { error[i] = 2; }
+			}
+			catch (...)
+			{
+				error[i] = 2;
+			}
+			j.trial_num_iterations[i] = maxiter;
+			j.trial_loglik_delta[i] = eps;
+			time_sec[i] = maxtime;
+			if (error[i] != 0)
+			{
+				status[i] = TRIAL_FAILED;
+			}
+			else if ((j.algorithm != 3 && j.algorithm != 4) || fabs(eps) < *j.loglik_delta || (*j.num_iterations >= 0 && maxiter >= *j.num_iterations) || (*j.time_sec >= 0 && maxtime >= *j.time_sec))
+			{
+				status[i] = TRIAL_DONE;
+			}
+		}
+
+		// Rank the trials that are still in the race
+		std::vector<TrialRank> ranks;
+		int num_running = 0;
+		for (int i=0; i<num_trials; i++)
+		{
+			if (status[i] == TRIAL_RUNNING || status[i] == TRIAL_DONE)
+			{
+				ranks.push_back(rank_trial(hmm[i], i, N, j.most_frequent_state));
+				j.trial_loglik[i] = ranks.back().loglik;
+			}
+			if (status[i] == TRIAL_RUNNING) num_running++;
+		}
+		if (num_running == 0) break;
+		std::stable_sort(ranks.begin(), ranks.end(), better_trial);
+
+		// Drop running trials in the lower half that are clearly behind the leader
+		double margin = TRIALS_PRUNE_MARGIN * fabs(ranks[0].loglik);
+		for (int r=(ranks.size()+1)/2; r<(int)ranks.size(); r++)
+		{
+			int i = ranks[r].index;
+			if (status[i] == TRIAL_RUNNING && ranks[0].loglik - ranks[r].loglik > margin)
+			{
+				status[i] = TRIAL_PRUNED;
+				j.trial_pruned[i] = 1;
+			}
+		}
+		budget *= 2;
+	}
+
+	// Select among the trials that ran to the end, fall back to the first trial if all failed
+	std::vector<TrialRank> ranks;
+	for (int i=0; i<num_trials; i++)
+	{
+		if (status[i] == TRIAL_DONE)
+		{
+			ranks.push_back(rank_trial(hmm[i], i, N, j.most_frequent_state));
+		}
+	}
+	int selected = 0;
+	if (ranks.size() > 0)
+	{
+		selected = std::min_element(ranks.begin(), ranks.end(), better_trial)->index;
+	}
+	*j.trial_selected = selected + 1;
+	*j.error = error[selected];
+	*j.num_iterations = j.trial_num_iterations[selected];
+	*j.loglik_delta = j.trial_loglik_delta[selected];
+	*j.time_sec = time_sec[selected];
+	get_univariate_results(hmm[selected], j.T, N, j.state_labels, j.states, j.size, j.prob, j.w, j.A, j.proba, j.loglik, j.weights, j.algorithm);
+	if (j.posterior_diff)
+	{
+		*j.posterior_diff_sum = hmm[selected]->get_posterior_diff();
+	}
+}
+
+SEXP univariate_hmm_batch(SEXP jobs, SEXP num_threads)
+{
+	// Everything that uses the R API is done here on the main thread: reading the inputs and allocating the outputs
+	int num_jobs = Rf_length(jobs);
+	std::vector<UnivariateJob> job(num_jobs);
+	const char* output_names[] = {"states", "size", "prob", "A", "proba", "loglik", "weights", "num.iterations", "time.sec", "loglik.delta", "error", "trial.loglik", "trial.loglik.delta", "trial.num.iterations", "trial.pruned", "trial.selected", "w", "posterior.diff"};
+	int num_outputs = 18;
+	SEXP results = PROTECT(Rf_allocVector(VECSXP, num_jobs));
+	for (int i=0; i<num_jobs; i++)
+	{
+		SEXP input = VECTOR_ELT(jobs, i);
+		UnivariateJob& j = job[i];
+		SEXP counts = get_list_element(input, "counts");
+		if (TYPEOF(counts) != INTSXP)
+		{
+			Rf_error("counts must be an integer vector");
+		}
+		j.O = INTEGER(counts);
+		j.T = Rf_length(counts);
+		j.state_labels = INTEGER(get_list_element(input, "state.labels"));
+		j.N = Rf_length(get_list_element(input, "state.labels"));
+		j.distr_type = INTEGER(get_list_element(input, "distr.type"));
+		j.initial_size = REAL(get_list_element(input, "size.initial"));
+		j.initial_prob = REAL(get_list_element(input, "prob.initial"));
+		j.initial_w = REAL(get_list_element(input, "w.initial"));
+		j.initial_A = REAL(get_list_element(input, "A.initial"));
+		j.initial_proba = REAL(get_list_element(input, "proba.initial"));
+		j.num_trials = Rf_length(get_list_element(input, "size.initial")) / j.N;
+		j.most_frequent_state = Rf_asInteger(get_list_element(input, "most.frequent.state")) - 1;
+		j.read_cutoff = Rf_asInteger(get_list_element(input, "count.cutoff"));
+		j.algorithm = Rf_asInteger(get_list_element(input, "algorithm"));
+		j.memory_mode = Rf_asInteger(get_list_element(input, "memory.mode"));
+		SEXP segment_starts = get_list_element(input, "segment.starts");
+		j.segment_starts = INTEGER(segment_starts);
+		j.num_segments = Rf_length(segment_starts);
+		j.posterior_diff = Rf_asLogical(get_list_element(input, "posterior.diff")) == TRUE;
+
+		SEXP output = PROTECT(Rf_allocVector(VECSXP, num_outputs));
+		SEXP names = PROTECT(Rf_allocVector(STRSXP, num_outputs));
+		for (int k=0; k<num_outputs; k++)
+		{
+			SET_STRING_ELT(names, k, Rf_mkChar(output_names[k]));
+		}
+		Rf_setAttrib(output, R_NamesSymbol, names);
+		SET_VECTOR_ELT(output, 0, Rf_allocVector(INTSXP, j.T));
+		SET_VECTOR_ELT(output, 1, Rf_allocVector(REALSXP, j.N));
+		SET_VECTOR_ELT(output, 2, Rf_allocVector(REALSXP, j.N));
+		SET_VECTOR_ELT(output, 3, Rf_allocVector(REALSXP, j.N * j.N));
+		SET_VECTOR_ELT(output, 4, Rf_allocVector(REALSXP, j.N));
+		SET_VECTOR_ELT(output, 5, Rf_allocVector(REALSXP, 1));
+		SET_VECTOR_ELT(output, 6, Rf_allocVector(REALSXP, j.N));
+		SET_VECTOR_ELT(output, 7, Rf_ScalarInteger(Rf_asInteger(get_list_element(input, "max.iter"))));
+		SET_VECTOR_ELT(output, 8, Rf_ScalarInteger(Rf_asInteger(get_list_element(input, "max.time"))));
+		SET_VECTOR_ELT(output, 9, Rf_ScalarReal(Rf_asReal(get_list_element(input, "eps"))));
+		SET_VECTOR_ELT(output, 10, Rf_ScalarInteger(0));
+		SET_VECTOR_ELT(output, 11, Rf_allocVector(REALSXP, j.num_trials));
+		SET_VECTOR_ELT(output, 12, Rf_allocVector(REALSXP, j.num_trials));
+		SET_VECTOR_ELT(output, 13, Rf_allocVector(INTSXP, j.num_trials));
+		SET_VECTOR_ELT(output, 14, Rf_allocVector(LGLSXP, j.num_trials));
+		SET_VECTOR_ELT(output, 15, Rf_ScalarInteger(1));
+		SET_VECTOR_ELT(output, 16, Rf_allocVector(REALSXP, j.N));
+		SET_VECTOR_ELT(output, 17, Rf_ScalarReal(NA_REAL));
+		j.states = INTEGER(VECTOR_ELT(output, 0));
+		j.size = REAL(VECTOR_ELT(output, 1));
+		j.prob = REAL(VECTOR_ELT(output, 2));
+		j.A = REAL(VECTOR_ELT(output, 3));
+		j.proba = REAL(VECTOR_ELT(output, 4));
+		j.loglik = REAL(VECTOR_ELT(output, 5));
+		j.weights = REAL(VECTOR_ELT(output, 6));
+		j.num_iterations = INTEGER(VECTOR_ELT(output, 7));
+		j.time_sec = INTEGER(VECTOR_ELT(output, 8));
+		j.loglik_delta = REAL(VECTOR_ELT(output, 9));
+		j.error = INTEGER(VECTOR_ELT(output, 10));
+		j.trial_loglik = REAL(VECTOR_ELT(output, 11));
+		j.trial_loglik_delta = REAL(VECTOR_ELT(output, 12));
+		j.trial_num_iterations = INTEGER(VECTOR_ELT(output, 13));
+		j.trial_pruned = LOGICAL(VECTOR_ELT(output, 14));
+		j.trial_selected = INTEGER(VECTOR_ELT(output, 15));
+		j.w = REAL(VECTOR_ELT(output, 16));
+		j.posterior_diff_sum = REAL(VECTOR_ELT(output, 17));
+		SET_VECTOR_ELT(results, i, output);
+		UNPROTECT(2);
+	}
+
+	// Largest jobs first
+	std::vector<UnivariateJob*> order(num_jobs);
+	for (int i=0; i<num_jobs; i++)
+	{
+		order[i] = &job[i];
+	}
+	std::stable_sort(order.begin(), order.end(), larger_job);
+
+	// Threads go to the jobs, or to the trials if there is only one job
+	int threads = std::max(Rf_asInteger(num_threads), 1);
+	int previous_num_threads = set_num_threads(threads);
+	int job_threads = std::max(std::min(threads, num_jobs), 1);
+	int trial_threads = (job_threads > 1) ? 1 : threads;
+
+	// Worker threads must not call the R API, the HMMs are quiet and cannot be interrupted
+	#pragma omp parallel for schedule(dynamic,1) num_threads(job_threads)
+	for (int i=0; i<num_jobs; i++)
+	{
+		UnivariateJob& j = *order[i];
+		try
+		{
+			run_univariate_trials(j, trial_threads);
+		}
+		catch (...)
+		{
+			*j.error = 2;
+		}
+	}
+
+	set_num_threads(previous_num_threads);
+	UNPROTECT(1);
+	return(results);
+}
+
+
+// =====================================================================================================================================================
+// This function decodes a batch of univariate observation sequences (e.g. one per cell) with the fixed parameters of a fitted HMM, without EM.
+// 'model' is a named list with the parameters, each element of 'cells' a named list with the capped counts and segment starts of one sequence.
+// Every thread creates one HMM for its first sequence and rebinds it to all further sequences with set_observations(), so that buffers and
+// density functions are reused. Sequences are handed out from the largest to the smallest, so the buffers of each thread are allocated only once.
+// The table of log(x!) covers the largest count of all sequences and is shared by all threads.
+// =====================================================================================================================================================
+struct DecodeJob
+{
+	// Input
+	int* O;
+	int T;
+	int num_segments;
+	int* segment_starts;
+	// Output
+	int* states;
+	double* loglik;
+	double* weights;
+	int* error;
+};
+
+static bool larger_decode_job(const DecodeJob* a, const DecodeJob* b)
+{
+	return(a->T > b->T);
+}
+
+SEXP univariate_decode(SEXP model, SEXP cells, SEXP algorithm, SEXP num_threads)
+{
+	// Everything that uses the R API is done here on the main thread: reading the inputs and allocating the outputs
+	int* state_labels = INTEGER(get_list_element(model, "state.labels"));
+	int N = Rf_length(get_list_element(model, "state.labels"));
+	int* distr_type = INTEGER(get_list_element(model, "distr.type"));
+	double* size = REAL(get_list_element(model, "size"));
+	double* prob = REAL(get_list_element(model, "prob"));
+	double* w = REAL(get_list_element(model, "w"));
+	double* A = REAL(get_list_element(model, "A"));
+	double* proba = REAL(get_list_element(model, "proba"));
+	int alg = Rf_asInteger(algorithm);
+
+	int num_cells = Rf_length(cells);
+	std::vector<DecodeJob> job(num_cells);
+	const char* output_names[] = {"states", "loglik", "weights", "error"};
+	int num_outputs = 4;
+	int max_obs = 0;
+	SEXP results = PROTECT(Rf_allocVector(VECSXP, num_cells));
+	for (int i=0; i<num_cells; i++)
+	{
+		SEXP input = VECTOR_ELT(cells, i);
+		DecodeJob& j = job[i];
+		SEXP counts = get_list_element(input, "counts");
+		if (TYPEOF(counts) != INTSXP)
+		{
+			Rf_error("counts must be an integer vector");
+		}
+		j.O = INTEGER(counts);
+		j.T = Rf_length(counts);
+		SEXP segment_starts = get_list_element(input, "segment.starts");
+		j.segment_starts = INTEGER(segment_starts);
+		j.num_segments = Rf_length(segment_starts);
+		max_obs = std::max(max_obs, intMax(j.O, j.T));
+
+		SEXP output = PROTECT(Rf_allocVector(VECSXP, num_outputs));
+		SEXP names = PROTECT(Rf_allocVector(STRSXP, num_outputs));
+		for (int k=0; k<num_outputs; k++)
+		{
+			SET_STRING_ELT(names, k, Rf_mkChar(output_names[k]));
+		}
+		Rf_setAttrib(output, R_NamesSymbol, names);
+		SET_VECTOR_ELT(output, 0, Rf_allocVector(INTSXP, j.T));
+		SET_VECTOR_ELT(output, 1, Rf_allocVector(REALSXP, 1));
+		SET_VECTOR_ELT(output, 2, Rf_allocVector(REALSXP, N));
+		SET_VECTOR_ELT(output, 3, Rf_ScalarInteger(0));
+		j.states = INTEGER(VECTOR_ELT(output, 0));
+		j.loglik = REAL(VECTOR_ELT(output, 1));
+		j.weights = REAL(VECTOR_ELT(output, 2));
+		j.error = INTEGER(VECTOR_ELT(output, 3));
+		SET_VECTOR_ELT(results, i, output);
+		UNPROTECT(2);
+	}
+
+	// Shared table of log(x!)
+	std::vector<double> lxfactorials(max_obs+1, 0.0);
+	for (int x=2; x<=max_obs; x++)
+	{
+		lxfactorials[x] = lxfactorials[x-1] + log(x);
+	}
+
+	// Largest sequences first
+	std::vector<DecodeJob*> order(num_cells);
+	for (int i=0; i<num_cells; i++)
+	{
+		order[i] = &job[i];
+	}
+	std::stable_sort(order.begin(), order.end(), larger_decode_job);
+
+	int threads = std::max(std::min(Rf_asInteger(num_threads), num_cells), 1);
+	int previous_num_threads = set_num_threads(threads);
+
+	// Worker threads must not call the R API, the HMMs are quiet and cannot be interrupted
+	#pragma omp parallel num_threads(threads)
+	{
+		ScaleHMM* hmm = NULL;
+		// Parameters are not changed by decoding, get_univariate_results() copies them into scratch vectors
+		std::vector<double> size_out(N), prob_out(N), w_out(N), A_out(N*N), proba_out(N);
+		#pragma omp for schedule(dynamic,1)
+		for (int i=0; i<num_cells; i++)
+		{
+			DecodeJob& j = *order[i];
+			try
+			{
+				if (hmm == NULL)
+				{
+					hmm = create_univariate_hmm(j.O, j.T, N, distr_type, size, prob, w, A, proba, true, max_obs, 1, j.num_segments, j.segment_starts, max_obs, &lxfactorials[0]);
+					hmm->set_quiet(true);
+					hmm->set_interruptible(false);
+				}
+				else
+				{
+					hmm->set_observations(j.O, j.T, j.num_segments, j.segment_starts);
+				}
+				int maxiter = 0, maxtime = -1;
+				double eps = 0;
+				run_hmm(hmm, &maxiter, &maxtime, &eps, alg, j.error, false);
+				if (*j.error == 0)
+				{
+					get_univariate_results(hmm, j.T, N, state_labels, j.states, &size_out[0], &prob_out[0], &w_out[0], &A_out[0], &proba_out[0], j.loglik, j.weights, alg);
+				}
+			}
+			catch (...)
+			{
+				*j.error = 2;
+			}
+		}
+		delete hmm;
+	}
+
+	set_num_threads(previous_num_threads);
+	UNPROTECT(1);
+	return(results);
 }
 
 
 // =====================================================================================================================================================
-// This function takes parameters from R, creates a multivariate HMM object, runs the EM and returns the result to R.
+// This function computes the Gaussian copula densities of the combined states for multivariate_hmm(). 'counts' is a matrix [T x Nmod], 'distr_type',
+// 'size', 'prob' and 'w' are matrices [num_uni_states x Nmod] with the univariate distributions of each modification ('w' is only read for zero-inflated
+// negative binomials), 'comb_uni_states' is a matrix [num_comb_states x Nmod] with the univariate states (1-based) of each combined state and
+// 'comb_state_per_bin' the combined state (1-based or NA) of each bin from which the correlations are estimated. Returns a matrix [T x num_comb_states]
+// of densities.
 // =====================================================================================================================================================
-void multivariate_hmm(double* D, int* T, int* N, int *Nmod, int* comb_states, int* maxiter, int* maxtime, double* eps, int* states, double* A, double* proba, double* loglik, double* initial_A, double* initial_proba, bool* use_initial_params, int* num_threads, int* error, int* algorithm)
+SEXP multivariate_densities(SEXP counts, SEXP distr_type, SEXP size, SEXP prob, SEXP w, SEXP comb_uni_states, SEXP comb_state_per_bin, SEXP num_threads)
+{
+	// Check the inputs before any C++ object is created, Rf_error() does not return
+	int T = Rf_length(comb_state_per_bin);
+	int Nmod = (T > 0) ? Rf_length(counts) / T : 0;
+	int num_uni_states = (Nmod > 0) ? Rf_length(distr_type) / Nmod : 0;
+	int num_comb_states = (Nmod > 0) ? Rf_length(comb_uni_states) / Nmod : 0;
+	for (int i=0; i<Rf_length(distr_type); i++)
+	{
+		if (INTEGER(distr_type)[i] < 1 || INTEGER(distr_type)[i] > 5)
+		{
+			Rf_error("copula densities are only implemented for the distributions 'delta', 'dgeom', 'dnbinom', 'dbinom' and 'dzinbinom'");
+		}
+	}
+	for (int i=0; i<Rf_length(comb_uni_states); i++)
+	{
+		if (INTEGER(comb_uni_states)[i] < 1 || INTEGER(comb_uni_states)[i] > num_uni_states)
+		{
+			Rf_error("combined state %d refers to an unknown univariate state", i % num_comb_states + 1);
+		}
+	}
+	for (int i=0; i<Rf_length(counts); i++)
+	{
+		if (INTEGER(counts)[i] < 0)
+		{
+			Rf_error("negative read counts");
+		}
+	}
+
+	SEXP densities = PROTECT(Rf_allocMatrix(REALSXP, T, num_comb_states));
+	CopulaDensities copula(INTEGER(counts), T, Nmod, num_uni_states, num_comb_states, INTEGER(comb_uni_states));
+	// The marginals call Rmath and are tabulated on the main thread, the densities of the combined states are computed in parallel
+	for (int imod=0; imod<Nmod; imod++)
+	{
+		for (int istate=0; istate<num_uni_states; istate++)
+		{
+			int i = imod*num_uni_states + istate;
+			copula.set_marginal(imod, istate, INTEGER(distr_type)[i], REAL(size)[i], REAL(prob)[i], REAL(w)[i]);
+		}
+	}
+	copula.estimate_correlations(INTEGER(comb_state_per_bin));
+	int previous_num_threads = set_num_threads(Rf_asInteger(num_threads));
+	copula.calc_densities(REAL(densities));
+	set_num_threads(previous_num_threads);
+
+	UNPROTECT(1);
+	return(densities);
+}
+
+
+// =====================================================================================================================================================
+// This function takes parameters from R, creates a multivariate HMM object, runs the EM and returns the result to R. 'densities' is the matrix
+// [T x N] from multivariate_densities(), the HMM reads its columns in place, so it is neither duplicated nor recoded. 'comb_states' are the labels of
+// the N combined states and 'params' a named list with the remaining settings. Returns a named list with the results.
+// =====================================================================================================================================================
+SEXP multivariate_hmm(SEXP densities, SEXP comb_states, SEXP params, SEXP num_threads)
 {
 
 	// Define logging level {"ERROR", "WARNING", "INFO", "ITERATION", "DEBUG", "DEBUG1", "DEBUG2", "DEBUG3", "DEBUG4"}
@@ -223,14 +932,74 @@ void multivariate_hmm(double* D, int* T, int* N, int *Nmod, int* comb_states, in
 //  	FILELog::ReportingLevel() = FILELog::FromString("DEBUG2");
 //  	FILELog::ReportingLevel() = FILELog::FromString("ERROR");
 
+	// Check the inputs before any C++ object is created, Rf_error() does not return
+	if (!Rf_isReal(densities) || !Rf_isMatrix(densities))
+	{
+		Rf_error("densities must be a numeric matrix");
+	}
+	int T = Rf_nrows(densities);
+	int N = Rf_ncols(densities);
+	if (Rf_length(comb_states) != N)
+	{
+		Rf_error("densities must have one column per combined state");
+	}
+	int Nmod = Rf_asInteger(get_list_element(params, "num.strands"));
+	SEXP initial_A = get_list_element(params, "A.initial");
+	SEXP initial_proba = get_list_element(params, "proba.initial");
+	if (Rf_length(initial_A) != N*N || Rf_length(initial_proba) != N)
+	{
+		Rf_error("initial parameters do not match the number of combined states");
+	}
+	bool use_initial_params = Rf_asLogical(get_list_element(params, "use.initial.params")) == TRUE;
+	int algorithm = Rf_asInteger(get_list_element(params, "algorithm"));
+	int kronecker = Rf_asInteger(get_list_element(params, "kronecker"));
+	double prune_threshold = Rf_asReal(get_list_element(params, "prune.threshold"));
+	bool readmit_pruned = Rf_asLogical(get_list_element(params, "readmit.pruned")) == TRUE;
+	bool posterior_diff = Rf_asLogical(get_list_element(params, "posterior.diff")) == TRUE;
+
+	// Outputs, num.iterations, time.sec and loglik.delta start with the limits of the EM
+	const char* output_names[] = {"states", "A", "proba", "loglik", "A.initial", "proba.initial", "num.iterations", "time.sec", "loglik.delta", "error", "pruned", "posterior.diff"};
+	int num_outputs = 12;
+	SEXP result = PROTECT(Rf_allocVector(VECSXP, num_outputs));
+	SEXP names = PROTECT(Rf_allocVector(STRSXP, num_outputs));
+	for (int k=0; k<num_outputs; k++)
+	{
+		SET_STRING_ELT(names, k, Rf_mkChar(output_names[k]));
+	}
+	Rf_setAttrib(result, R_NamesSymbol, names);
+	SET_VECTOR_ELT(result, 0, Rf_allocVector(INTSXP, T));
+	SET_VECTOR_ELT(result, 1, Rf_allocVector(REALSXP, N * N));
+	SET_VECTOR_ELT(result, 2, Rf_allocVector(REALSXP, N));
+	SET_VECTOR_ELT(result, 3, Rf_allocVector(REALSXP, 1));
+	SET_VECTOR_ELT(result, 4, Rf_duplicate(initial_A));
+	SET_VECTOR_ELT(result, 5, Rf_duplicate(initial_proba));
+	SET_VECTOR_ELT(result, 6, Rf_ScalarInteger(Rf_asInteger(get_list_element(params, "max.iter"))));
+	SET_VECTOR_ELT(result, 7, Rf_ScalarInteger(Rf_asInteger(get_list_element(params, "max.time"))));
+	SET_VECTOR_ELT(result, 8, Rf_ScalarReal(Rf_asReal(get_list_element(params, "eps"))));
+	SET_VECTOR_ELT(result, 9, Rf_ScalarInteger(0));
+	SET_VECTOR_ELT(result, 10, Rf_allocVector(INTSXP, N));
+	SET_VECTOR_ELT(result, 11, Rf_ScalarReal(NA_REAL));
+	int* states = INTEGER(VECTOR_ELT(result, 0));
+	double* A = REAL(VECTOR_ELT(result, 1));
+	double* proba = REAL(VECTOR_ELT(result, 2));
+	double* loglik = REAL(VECTOR_ELT(result, 3));
+	double* A_initial = REAL(VECTOR_ELT(result, 4));
+	double* proba_initial = REAL(VECTOR_ELT(result, 5));
+	int* maxiter = INTEGER(VECTOR_ELT(result, 6));
+	int* maxtime = INTEGER(VECTOR_ELT(result, 7));
+	double* eps = REAL(VECTOR_ELT(result, 8));
+	int* error = INTEGER(VECTOR_ELT(result, 9));
+	int* pruned = INTEGER(VECTOR_ELT(result, 10));
+	double* posterior_diff_sum = REAL(VECTOR_ELT(result, 11));
+
 	// Parallelization settings
-// 	omp_set_num_threads(*num_threads);
+	int previous_num_threads = set_num_threads(Rf_asInteger(num_threads));
 
 	// Print some information
-	//FILE_LOG(logINFO) << "number of states = " << *N;
-	Rprintf("number of states = %d\n", *N);
-	//FILE_LOG(logINFO) << "number of bins = " << *T;
-	Rprintf("number of bins = %d\n", *T);
+	//FILE_LOG(logINFO) << "number of states = " << N;
+	Rprintf("number of states = %d\n", N);
+	//FILE_LOG(logINFO) << "number of bins = " << T;
+	Rprintf("number of bins = %d\n", T);
 	if (*maxiter < 0)
 	{
 		//FILE_LOG(logINFO) << "maximum number of iterations = none";
@@ -249,119 +1018,129 @@ void multivariate_hmm(double* D, int* T, int* N, int *Nmod, int* comb_states, in
 	}
 	//FILE_LOG(logINFO) << "epsilon = " << *eps;
 	Rprintf("epsilon = %g\n", *eps);
-	//FILE_LOG(logINFO) << "number of modifications = " << *Nmod;
-	Rprintf("number of modifications = %d\n", *Nmod);
+	//FILE_LOG(logINFO) << "number of modifications = " << Nmod;
+	Rprintf("number of modifications = %d\n", Nmod);
+	if (kronecker > 0)
+	{
+		Rprintf("transition matrix = Kronecker product of %d x %d and %d x %d\n", kronecker, kronecker, N / kronecker, N / kronecker);
+	}
+	if (prune_threshold > 0)
+	{
+		Rprintf("pruning threshold = %g\n", prune_threshold);
+	}
 
 	// Flush Rprintf statements to console
 	R_FlushConsole();
 
-	// Recode the densities vector to matrix representation
-// 	clock_t clocktime = clock(), dtime;
-	multiD = CallocDoubleMatrix(*N, *T);
-	for (int iN=0; iN<*N; iN++)
+	// Create the HMM on the column-major densities of R
+	//FILE_LOG(logDEBUG1) << "Creating the multivariate HMM";
+	ScaleHMM* hmm = new ScaleHMM(T, N, Nmod, REAL(densities));
+	SEXP hmm_ptr = PROTECT(R_MakeExternalPtr(hmm, R_NilValue, R_NilValue));
+	R_RegisterCFinalizerEx(hmm_ptr, finalize_hmm, TRUE);
+	// Factorize the transition matrix into one matrix per modification
+	if (kronecker > 0)
 	{
-		for (int t=0; t<*T; t++)
-		{
-			multiD[iN][t] = D[iN*(*T)+t];
-		}
+		hmm->set_kronecker(kronecker);
 	}
-// 	dtime = clock() - clocktime;
-// 	//FILE_LOG(logDEBUG1) << "recoding densities vector to matrix representation: " << dtime << " clicks";
-
-	// Create the HMM
-	//FILE_LOG(logDEBUG1) << "Creating the multivariate HMM";
-	hmm = new ScaleHMM(*T, *N, *Nmod, multiD);
+	// Drop combined states without posterior mass during the EM
+	if (prune_threshold > 0)
+	{
+		hmm->set_pruning(prune_threshold);
+	}
+	hmm->set_posterior_diff(posterior_diff);
 	// Initialize the transition probabilities and proba
-	hmm->initialize_transition_probs(initial_A, *use_initial_params);
-	hmm->initialize_proba(initial_proba, *use_initial_params);
+	hmm->initialize_transition_probs(A_initial, use_initial_params);
+	hmm->initialize_proba(proba_initial, use_initial_params);
 	
 	// Print logproba and A
-// 	for (int iN=0; iN<*N; iN++)
+// 	for (int iN=0; iN<N; iN++)
 // 	{
 // 		//FILE_LOG(logDEBUG) << "proba["<<iN<<"] = " <<exp(hmm->logproba[iN]);
-// 		for (int jN=0; jN<*N; jN++)
+// 		for (int jN=0; jN<N; jN++)
 // 		{
 // 			//FILE_LOG(logDEBUG) << "A["<<iN<<"]["<<jN<<"] = " << hmm->A[iN][jN];
 // 		}
 // 	}
 
 	// Do the EM to estimate the parameters
-	try
+	run_hmm(hmm, maxiter, maxtime, eps, algorithm, error, true);
+
+	// Report the pruned states and optionally compute the posteriors of all states with the final parameters
+	bool any_pruned = false;
+	for (int iN=0; iN<N; iN++)
 	{
-		if (*algorithm == 1)
-		{
-			hmm->baumWelch();
-		}
-		else if (*algorithm == 3)
-		{
-			//FILE_LOG(logDEBUG1) << "Starting EM estimation";
-			hmm->EM(maxiter, maxtime, eps);
-			//FILE_LOG(logDEBUG1) << "Finished with EM estimation";
-		}
+		pruned[iN] = hmm->is_pruned(iN);
+		any_pruned = any_pruned || pruned[iN];
 	}
-	catch (std::exception& e)
+	if (any_pruned && readmit_pruned && *error == 0)
 	{
-		//FILE_LOG(logERROR) << "Error in EM/baumWelch: " << e.what();
-		Rprintf("Error in EM/baumWelch: %s\n", e.what());
-		if (strcmp(e.what(),"nan detected")==0) { *error = 1; }
-		else { *error = 2; }
+		Rprintf("Re-admitting pruned states\n");
+		hmm->restore_states();
+		run_hmm(hmm, maxiter, maxtime, eps, 1, error, true);
 	}
-	
-// 	// Compute the posteriors and save results directly to the R pointer
-// 	//FILE_LOG(logDEBUG1) << "Recode posteriors into column representation";
-// 	for (int iN=0; iN<*N; iN++)
-// 	{
-// 		for (int t=0; t<*T; t++)
-// 		{
-// 			posteriors[t + iN * (*T)] = hmm->get_posterior(iN, t);
-// 		}
-// 	}
 
-	// Compute the states from posteriors
+	// Compute the states from posteriors or the Viterbi path
 	//FILE_LOG(logDEBUG1) << "Computing states from posteriors";
+	const int* labels = INTEGER(comb_states);
 	int ind_max;
-	std::vector<double> posterior_per_t(*N);
-	for (int t=0; t<*T; t++)
+	std::vector<double> posterior_per_t(N);
+	for (int t=0; t<T; t++)
 	{
-		for (int iN=0; iN<*N; iN++)
+		if (algorithm == 2)
+		{
+			states[t] = labels[hmm->get_viterbi_state(t)];
+			continue;
+		}
+		for (int iN=0; iN<N; iN++)
 		{
 			posterior_per_t[iN] = hmm->get_posterior(iN, t);
 		}
 		ind_max = std::distance(posterior_per_t.begin(), std::max_element(posterior_per_t.begin(), posterior_per_t.end()));
-		states[t] = comb_states[ind_max];
+		states[t] = labels[ind_max];
 	}
 	
 	//FILE_LOG(logDEBUG1) << "Return parameters";
 	// also return the estimated transition matrix and the initial probs
-	for (int i=0; i<*N; i++)
+	for (int i=0; i<N; i++)
 	{
 		proba[i] = hmm->get_proba(i);
-		for (int j=0; j<*N; j++)
+		for (int j=0; j<N; j++)
 		{
-				A[i * (*N) + j] = hmm->get_A(j,i);
+				A[i * N + j] = hmm->get_A(j,i);
 		}
 	}
-	*loglik = hmm->get_logP();
+	*loglik = (algorithm == 2) ? hmm->get_viterbi_logP() : hmm->get_logP();
+	if (posterior_diff)
+	{
+		*posterior_diff_sum = hmm->get_posterior_diff();
+	}
 
 	//FILE_LOG(logDEBUG1) << "Deleting the hmm";
 	delete hmm;
-	hmm = NULL; // assign NULL to defuse the additional delete in on.exit() call
-// 	FreeDoubleMatrix(multiD, *N);
+	R_ClearExternalPtr(hmm_ptr);
+	set_num_threads(previous_num_threads);
+	UNPROTECT(3);
+	return(result);
 }
 
 
-// =======================================================
-// This function make a cleanup if anything was left over
-// =======================================================
-void univariate_cleanup()
-{
-// 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__; // This message will be shown if interrupt happens before start of C-code
-	delete hmm;
-}
-
-void multivariate_cleanup(int* N)
+// =====================================================================================================================================================
+// This function returns the tables of lgamma, digamma and trigamma at x, x+1, ..., x+n as the columns of a matrix [(n+1) x 3], so that the tests can
+// compare the recurrences with R's lgamma(), digamma() and trigamma().
+// =====================================================================================================================================================
+SEXP special_function_tables(SEXP x, SEXP n)
 {
-	delete hmm;
-	FreeDoubleMatrix(multiD, *N);
+	double x0 = Rf_asReal(x);
+	int num = Rf_asInteger(n);
+	if (num < 0 || !(x0 > 0))
+	{
+		Rf_error("x must be positive and n non-negative");
+	}
+	SEXP tables = PROTECT(Rf_allocMatrix(REALSXP, num+1, 3));
+	double* columns = REAL(tables);
+	lgamma_table(x0, num, columns);
+	digamma_table(x0, num, columns + (num+1));
+	trigamma_table(x0, num, columns + 2*(num+1));
+	UNPROTECT(1);
+	return(tables);
 }
-
@@ -4,23 +4,32 @@
 #include "utility.h"
 #include "scalehmm.h"
 #include "loghmm.h"
+#define R_NO_REMAP // keep Rinternals.h from redefining names like length() that the C++ headers use
+#include <Rinternals.h> // external pointers for cleanup after interrupts
 #include <string> // strcmp
+#include <vector>
+#include <algorithm> // std::stable_sort
 
-// #if defined TARGET_OS_MAC || defined __APPLE__
-// #include <libiomp/omp.h> // parallelization options on mac
-// #elif defined __linux__ || defined _WIN32 || defined _WIN64
-// #include <omp.h> // parallelization options
-// #endif
+#ifdef _OPENMP
+#include <omp.h> // parallelization options, only if R was built with OpenMP support
+#endif
 
 extern "C"
-void univariate_hmm(int* O, int* T, int* N, int* state_labels, double* size, double* prob, int* maxiter, int* maxtime, double* eps, int* states, double* A, double* proba, double* loglik, double* weights, int* distr_type, double* initial_size, double* initial_prob, double* initial_A, double* initial_proba, bool* use_initial_params, int* num_threads, int* error, int* read_cutoff, int* algorithm);
+void univariate_hmm(int* O, int* T, int* N, int* state_labels, double* size, double* prob, int* maxiter, int* maxtime, double* eps, int* states, double* A, double* proba, double* loglik, double* weights, int* distr_type, double* initial_size, double* initial_prob, double* initial_A, double* initial_proba, bool* use_initial_params, int* num_threads, int* error, int* read_cutoff, int* algorithm, int* memory_mode, int* num_segments, int* segment_starts, double* w, double* initial_w, int* posterior_diff);
 
 extern "C"
-void multivariate_hmm(double* D, int* T, int* N, int *Nmod, int* comb_states, int* maxiter, int* maxtime, double* eps, int* states, double* A, double* proba, double* loglik, double* initial_A, double* initial_proba, bool* use_initial_params, int* num_threads, int* error, int* algorithm);
+SEXP multivariate_hmm(SEXP densities, SEXP comb_states, SEXP params, SEXP num_threads);
+
+
 
 extern "C"
-void univariate_cleanup();
+SEXP univariate_hmm_batch(SEXP jobs, SEXP num_threads);
 
 extern "C"
-void multivariate_cleanup(int* N);
+SEXP univariate_decode(SEXP model, SEXP cells, SEXP algorithm, SEXP num_threads);
 
+extern "C"
+SEXP multivariate_densities(SEXP counts, SEXP distr_type, SEXP size, SEXP prob, SEXP w, SEXP comb_uni_states, SEXP comb_state_per_bin, SEXP num_threads);
+
+extern "C"
+SEXP special_function_tables(SEXP x, SEXP n);
@@ -25,12 +25,12 @@ Normal::~Normal()
 }
 
 // Methods ----------------------------------------------------
-void Normal::calc_densities(double* density)
+void Normal::calc_densities_per_read(double* dens_per_read, int max_obs)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	for (int t=0; t<this->T; t++)
+	for (int j=0; j<=max_obs; j++)
 	{
-		density[t] = dnorm(this->obs[t], this->mean, this->sd, 0);
+		dens_per_read[j] = dnorm(j, this->mean, this->sd, 0);
 	}
 }
 
@@ -63,6 +63,13 @@ void Normal::set_name(DensityName name)
 	this->name = name;
 }
 
+void Normal::set_observations(int* observations, int T)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->obs = observations;
+	this->T = T;
+}
+
 double Normal::get_mean()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
@@ -184,50 +191,23 @@ void Poisson::calc_logdensities(double* logdens)
 	}
 } 
 
-void Poisson::calc_densities(double* dens)
+void Poisson::calc_densities_per_read(double* dens_per_read, int max_obs)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	double logl = log(this->lambda);
 	double l = this->lambda;
-	double lxfactorial;
-	// Select strategy for computing densities
-	if (this->max_obs <= this->T)
+	for (int j=0; j<=max_obs; j++)
 	{
-		//FILE_LOG(logDEBUG2) << "Precomputing densities in " << __func__ << " for every obs[t], because max(O)<=T";
-		std::vector<double> dens_per_read(this->max_obs+1);
-		for (int j=0; j<=this->max_obs; j++)
+		dens_per_read[j] = exp( j*logl - l - this->lxfactorials[j] );
+		//FILE_LOG(logDEBUG4) << "dens_per_read["<<j<<"] = " << dens_per_read[j];
+		if (std::isnan(dens_per_read[j]))
 		{
-			dens_per_read[j] = exp( j*logl - l - this->lxfactorials[j] );
-		}
-		for (int t=0; t<this->T; t++)
-		{
-			dens[t] = dens_per_read[(int) this->obs[t]];
-			//FILE_LOG(logDEBUG4) << "dens["<<t<<"] = " << dens[t];
-			if (std::isnan(dens[t]))
-			{
-				//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
-				//FILE_LOG(logERROR) << "dens["<<t<<"] = "<< dens[t];
-				throw nan_detected;
-			}
+			//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
+			//FILE_LOG(logERROR) << "dens_per_read["<<j<<"] = "<< dens_per_read[j];
+			throw nan_detected;
 		}
 	}
-	else
-	{
-		//FILE_LOG(logDEBUG2) << "Computing densities in " << __func__ << " for every t, because max(O)>T";
-		for (int t=0; t<this->T; t++)
-		{
-			lxfactorial = this->lxfactorials[(int) this->obs[t]];
-			dens[t] = exp( this->obs[t]*logl - l - lxfactorial );
-			//FILE_LOG(logDEBUG4) << "dens["<<t<<"] = " << dens[t];
-			if (std::isnan(dens[t]))
-			{
-				//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
-				//FILE_LOG(logERROR) << "dens["<<t<<"] = "<< dens[t];
-				throw nan_detected;
-			}
-		}
-	}
-} 
+}
 
 void Poisson::update(double* weights)
 {
@@ -316,6 +296,13 @@ void Poisson::set_name(DensityName name)
 	this->name = name;
 }
 
+void Poisson::set_observations(int* observations, int T)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->obs = observations;
+	this->T = T;
+}
+
 double Poisson::get_lambda()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
@@ -337,6 +324,7 @@ NegativeBinomial::NegativeBinomial(int* observations, int T, double size, double
 	this->size = size;
 	this->prob = prob;
 	this->lxfactorials = NULL;
+	this->own_lxfactorials = true;
 	// Precompute the lxfactorials that are used in computing the densities
 	if (this->obs != NULL)
 	{
@@ -351,10 +339,24 @@ NegativeBinomial::NegativeBinomial(int* observations, int T, double size, double
 	}
 }
 
+NegativeBinomial::NegativeBinomial(int* observations, int T, double size, double prob, int max_obs, double* lxfactorials)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	// Use the precomputed lxfactorials[0..max_obs] of the caller, e.g. to share them between all states and trials on the same observations
+	this->name = NEGATIVE_BINOMIAL;
+	this->obs = observations;
+	this->T = T;
+	this->size = size;
+	this->prob = prob;
+	this->max_obs = max_obs;
+	this->lxfactorials = lxfactorials;
+	this->own_lxfactorials = false;
+}
+
 NegativeBinomial::~NegativeBinomial()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	if (this->lxfactorials != NULL)
+	if (this->lxfactorials != NULL && this->own_lxfactorials)
 	{
 		Free(this->lxfactorials);
 	}
@@ -373,9 +375,11 @@ void NegativeBinomial::calc_logdensities(double* logdens)
 	{
 		//FILE_LOG(logDEBUG2) << "Precomputing gammas in " << __func__ << " for every obs[t], because max(O)<=T";
 		std::vector<double> logdens_per_read(this->max_obs+1);
+		std::vector<double> lGammaRplusJ(this->max_obs+1);
+		lgamma_table(this->size, this->max_obs, &lGammaRplusJ[0]);
 		for (int j=0; j<=this->max_obs; j++)
 		{
-			logdens_per_read[j] = lgamma(this->size + j) - lGammaR - lxfactorials[j] + this->size * logp + j * log1minusp;
+			logdens_per_read[j] = lGammaRplusJ[j] - lGammaR - lxfactorials[j] + this->size * logp + j * log1minusp;
 		}
 		for (int t=0; t<this->T; t++)
 		{
@@ -408,54 +412,40 @@ void NegativeBinomial::calc_logdensities(double* logdens)
 	}
 } 
 
-void NegativeBinomial::calc_densities(double* dens)
+void NegativeBinomial::calc_densities_per_read(double* dens_per_read, int max_obs)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	double logp = log(this->prob);
 	double log1minusp = log(1-this->prob);
-	double lGammaR,lGammaRplusX,lxfactorial;
-	lGammaR=lgamma(this->size);
-	// Select strategy for computing gammas
-	if (this->max_obs <= this->T)
+	double lGammaR = lgamma(this->size);
+	// lgamma(size+j) is written to dens_per_read first and replaced by the density
+	lgamma_table(this->size, max_obs, dens_per_read);
+	for (int j=0; j<=max_obs; j++)
 	{
-		//FILE_LOG(logDEBUG2) << "Precomputing gammas in " << __func__ << " for every obs[t], because max(O)<=T";
-		std::vector<double> dens_per_read(this->max_obs+1);
-		for (int j=0; j<=this->max_obs; j++)
+		dens_per_read[j] = exp( dens_per_read[j] - lGammaR - lxfactorials[j] + this->size * logp + j * log1minusp );
+		//FILE_LOG(logDEBUG4) << "dens_per_read["<<j<<"] = " << dens_per_read[j];
+		if (std::isnan(dens_per_read[j]))
 		{
-			dens_per_read[j] = exp( lgamma(this->size + j) - lGammaR - lxfactorials[j] + this->size * logp + j * log1minusp );
-		}
-		for (int t=0; t<this->T; t++)
-		{
-			dens[t] = dens_per_read[(int) this->obs[t]];
-			//FILE_LOG(logDEBUG4) << "dens["<<t<<"] = " << dens[t];
-			if (std::isnan(dens[t]))
-			{
-				//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
-				//FILE_LOG(logERROR) << "dens["<<t<<"] = "<< dens[t];
-				throw nan_detected;
-			}
+			//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
+			//FILE_LOG(logERROR) << "dens_per_read["<<j<<"] = "<< dens_per_read[j];
+			throw nan_detected;
 		}
 	}
-	else
+}
+
+void NegativeBinomial::update(double* weights)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	// The summands depend on t only through obs[t], so the weights are summed per read count once and the Newton iterations run over read counts
+	std::vector<double> weights_per_read(this->max_obs+1, 0.0);
+	for (int t=0; t<this->T; t++)
 	{
-		//FILE_LOG(logDEBUG2) << "Computing gammas in " << __func__ << " for every t, because max(O)>T";
-		for (int t=0; t<this->T; t++)
-		{
-			lGammaRplusX = lgamma(this->size + this->obs[t]);
-			lxfactorial = this->lxfactorials[(int) this->obs[t]];
-			dens[t] = exp( lGammaRplusX - lGammaR - lxfactorial + this->size * logp + this->obs[t] * log1minusp );
-			//FILE_LOG(logDEBUG4) << "dens["<<t<<"] = " << dens[t];
-			if (std::isnan(dens[t]))
-			{
-				//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
-				//FILE_LOG(logERROR) << "dens["<<t<<"] = "<< dens[t];
-				throw nan_detected;
-			}
-		}
+		weights_per_read[this->obs[t]] += weights[t];
 	}
-} 
+	this->update_per_read(&weights_per_read[0]);
+}
 
-void NegativeBinomial::update(double* weights)
+void NegativeBinomial::update_per_read(double* weights_per_read)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	//FILE_LOG(logDEBUG1) << "size = "<<this->size << ", prob = "<<this->prob;
@@ -468,10 +458,10 @@ void NegativeBinomial::update(double* weights)
 	numerator=denominator=0.0;
 // 	clock_t time, dtime;
 // 	time = clock();
-	for (int t=0; t<this->T; t++)
+	for (int j=0; j<=this->max_obs; j++)
 	{
-		numerator += weights[t] * this->size;
-		denominator += weights[t] * (this->size + this->obs[t]);
+		numerator += weights_per_read[j] * this->size;
+		denominator += weights_per_read[j] * (this->size + j);
 	}
 	if (denominator > 0) // only update if not nan
 	{
@@ -485,89 +475,36 @@ void NegativeBinomial::update(double* weights)
 	// Update of size with Newton Method
 	size0 = this->size;
 // 	time = clock();
-	// Select strategy for computing digammas
-	if (this->max_obs <= this->T)
+	std::vector<double> DigammaSizePlusX(this->max_obs+1);
+	std::vector<double> TrigammaSizePlusX(this->max_obs+1);
+	for (int k=0; k<kmax; k++)
 	{
-		//FILE_LOG(logDEBUG2) << "Precomputing digammas in " << __func__ << " for every obs[t], because max(O)<=T";
-		std::vector<double> DigammaSizePlusX(this->max_obs+1);
-		std::vector<double> TrigammaSizePlusX(this->max_obs+1);
-		for (int k=0; k<kmax; k++)
+		F=dFdSize=0.0;
+		digamma_table(size0, this->max_obs, &DigammaSizePlusX[0]);
+		trigamma_table(size0, this->max_obs, &TrigammaSizePlusX[0]);
+		DigammaSize = DigammaSizePlusX[0];
+		TrigammaSize = TrigammaSizePlusX[0];
+		F += weights_per_read[0] * logp;
+		// Read counts without weight do not contribute, the tables are still built over all read counts because the recurrences need every step
+		for (int j=1; j<=this->max_obs; j++)
 		{
-			F=dFdSize=0.0;
-			DigammaSize = digamma(size0); // boost::math::digamma<>(size0);
-			TrigammaSize = trigamma(size0); // boost::math::digamma<>(size0);
-			// Precompute the digammas by iterating over all possible values of the observation vector
-			for (int j=0; j<=this->max_obs; j++)
-			{
-				DigammaSizePlusX[j] = digamma(size0+j);
-				TrigammaSizePlusX[j] = trigamma(size0+j);
-			}
-			for(int t=0; t<this->T; t++)
-			{
-				if(this->obs[t]==0)
-				{
-					F += weights[t] * logp;
-					//dFdSize+=0;
-				}
-				if(this->obs[t]!=0)
-				{
-					F += weights[t] * (logp - DigammaSize + DigammaSizePlusX[(int)obs[t]]);
-					dFdSize += weights[t] * (-TrigammaSize + TrigammaSizePlusX[(int)obs[t]]);
-				}
-			}
-			FdivM = F/dFdSize;
+			if (weights_per_read[j] == 0) continue;
+			F += weights_per_read[j] * (logp - DigammaSize + DigammaSizePlusX[j]);
+			dFdSize += weights_per_read[j] * (-TrigammaSize + TrigammaSizePlusX[j]);
+		}
+		FdivM = F/dFdSize;
 // Rprintf("k = %d, F = %g, dFdSize = %g, FdivM = %g, size0 = %g\n", k, F, dFdSize, FdivM, size0);
-			if (FdivM < size0)
-			{
-				size0 = size0-FdivM;
-			}
-			else if (FdivM >= size0)
-			{
-				size0 = size0/2.0;
-			}
-			if(fabs(F)<eps)
-			{
-				break;
-			}
+		if (FdivM < size0)
+		{
+			size0 = size0-FdivM;
 		}
-	}
-	else
-	{
-		//FILE_LOG(logDEBUG2) << "Computing digammas in " << __func__ << " for every t, because max(O)>T";
-		double DigammaSizePlusX, TrigammaSizePlusX;
-		for (int k=0; k<kmax; k++)
+		else if (FdivM >= size0)
 		{
-			F = dFdSize = 0.0;
-			DigammaSize = digamma(size0); // boost::math::digamma<>(size0);
-			TrigammaSize = trigamma(size0); // boost::math::digamma<>(size0);
-			for(int t=0; t<this->T; t++)
-			{
-				DigammaSizePlusX = digamma(size0+this->obs[t]); //boost::math::digamma<>(size0+this->obs[ti]);
-				TrigammaSizePlusX = trigamma(size0+this->obs[t]);
-				if(this->obs[t]==0)
-				{
-					F += weights[t] * logp;
-					//dFdSize+=0;
-				}
-				if(this->obs[t]!=0)
-				{
-					F += weights[t] * (logp - DigammaSize + DigammaSizePlusX);
-					dFdSize += weights[t] * (-TrigammaSize + TrigammaSizePlusX);
-				}
-			}
-			FdivM = F/dFdSize;
-			if (FdivM < size0)
-			{
-				size0 = size0-FdivM;
-			}
-			else if (FdivM >= size0)
-			{
-				size0 = size0/2.0;
-			}
-			if(fabs(F)<eps)
-			{
-				break;
-			}
+			size0 = size0/2.0;
+		}
+		if(fabs(F)<eps)
+		{
+			break;
 		}
 	}
 	this->size = size0;
@@ -581,6 +518,23 @@ void NegativeBinomial::update(double* weights)
 }
 
 void NegativeBinomial::update_constrained(double** weights, int fromState, int toState)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	// Sum the weights of each state per read count, as in update()
+	int num_states = toState-fromState;
+	std::vector<double> weights_per_read((size_t)num_states * (this->max_obs+1), 0.0);
+	for (int i=0; i<num_states; i++)
+	{
+		double* weights_i = &weights_per_read[(size_t)i * (this->max_obs+1)];
+		for (int t=0; t<this->T; t++)
+		{
+			weights_i[this->obs[t]] += weights[i+fromState][t];
+		}
+	}
+	this->update_constrained_per_read(&weights_per_read[0], num_states);
+}
+
+void NegativeBinomial::update_constrained_per_read(double* weights_per_read, int num_states)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	//FILE_LOG(logDEBUG1) << "size = "<<this->size << ", prob = "<<this->prob;
@@ -589,16 +543,18 @@ void NegativeBinomial::update_constrained(double** weights, int fromState, int t
 	double numerator, denominator, size0, DigammaSize, TrigammaSize;
 	double F, dFdSize, FdivM;
 	double logp = log(this->prob);
+	int ld = this->max_obs+1;
 	// Update prob (p)
 	numerator=denominator=0.0;
 // 	clock_t time, dtime;
 // 	time = clock();
-	for (int i=0; i<toState-fromState; i++)
+	for (int i=0; i<num_states; i++)
 	{
-		for (int t=0; t<this->T; t++)
+		const double* weights_i = weights_per_read + (size_t)i * ld;
+		for (int j=0; j<=this->max_obs; j++)
 		{
-			numerator += weights[i+fromState][t] * this->size*(i+1);
-			denominator += weights[i+fromState][t] * (this->size*(i+1) + this->obs[t]);
+			numerator += weights_i[j] * this->size*(i+1);
+			denominator += weights_i[j] * (this->size*(i+1) + j);
 		}
 	}
 	if (denominator > 0) // only update if not nan
@@ -613,95 +569,40 @@ void NegativeBinomial::update_constrained(double** weights, int fromState, int t
 	// Update of size with Newton Method
 	size0 = this->size;
 // 	time = clock();
-	// Select strategy for computing digammas
-	if (this->max_obs <= this->T)
+	std::vector<double> DigammaSizePlusX(this->max_obs+1);
+	std::vector<double> TrigammaSizePlusX(this->max_obs+1);
+	for (int k=0; k<kmax; k++)
 	{
-		//FILE_LOG(logDEBUG2) << "Precomputing digammas in " << __func__ << " for every obs[t], because max(O)<=T";
-		std::vector<double> DigammaSizePlusX(this->max_obs+1);
-		std::vector<double> TrigammaSizePlusX(this->max_obs+1);
-		for (int k=0; k<kmax; k++)
+		F=dFdSize=0.0;
+		for (int i=0; i<num_states; i++)
 		{
-			F=dFdSize=0.0;
-			for (int i=0; i<toState-fromState; i++)
+			const double* weights_i = weights_per_read + (size_t)i * ld;
+			digamma_table((i+1)*size0, this->max_obs, &DigammaSizePlusX[0]);
+			trigamma_table((i+1)*size0, this->max_obs, &TrigammaSizePlusX[0]);
+			DigammaSize = DigammaSizePlusX[0];
+			TrigammaSize = TrigammaSizePlusX[0];
+			F += weights_i[0] * (i+1) * logp;
+			// Read counts without weight do not contribute
+			for (int j=1; j<=this->max_obs; j++)
 			{
-				DigammaSize = digamma((i+1)*size0); // boost::math::digamma<>(size0);
-				TrigammaSize = trigamma((i+1)*size0); // boost::math::digamma<>(size0);
-				// Precompute the digammas by iterating over all possible values of the observation vector
-				for (int j=0; j<=this->max_obs; j++)
-				{
-					DigammaSizePlusX[j] = digamma((i+1)*size0+j);
-					TrigammaSizePlusX[j] = trigamma((i+1)*size0+j);
-				}
-				for(int t=0; t<this->T; t++)
-				{
-					if(this->obs[t]==0)
-					{
-						F += weights[i+fromState][t] * (i+1) * logp;
-						//dFdSize+=0;
-					}
-					if(this->obs[t]!=0)
-					{
-						F += weights[i+fromState][t] * (i+1) * (logp - DigammaSize + DigammaSizePlusX[(int)obs[t]]);
-						dFdSize += weights[i+fromState][t] * pow((i+1),2) * (-TrigammaSize + TrigammaSizePlusX[(int)obs[t]]);
-					}
-				}
+				if (weights_i[j] == 0) continue;
+				F += weights_i[j] * (i+1) * (logp - DigammaSize + DigammaSizePlusX[j]);
+				dFdSize += weights_i[j] * pow((i+1),2) * (-TrigammaSize + TrigammaSizePlusX[j]);
 			}
-			FdivM = F/dFdSize;
+		}
+		FdivM = F/dFdSize;
 // Rprintf("k = %d, F = %g, dFdSize = %g, FdivM = %g, size0 = %g, prob = %g\n", k, F, dFdSize, FdivM, size0, this->prob);
-			if (FdivM < size0)
-			{
-				size0 = size0-FdivM;
-			}
-			else if (FdivM >= size0)
-			{
-				size0 = size0/2.0;
-			}
-			if(fabs(F)<eps)
-			{
-				break;
-			}
+		if (FdivM < size0)
+		{
+			size0 = size0-FdivM;
 		}
-	}
-	else
-	{
-		//FILE_LOG(logDEBUG2) << "Computing digammas in " << __func__ << " for every t, because max(O)>T";
-		double DigammaSizePlusX, TrigammaSizePlusX;
-		for (int k=0; k<kmax; k++)
+		else if (FdivM >= size0)
 		{
-			F = dFdSize = 0.0;
-			for (int i=0; i<toState-fromState; i++)
-			{
-				DigammaSize = digamma((i+1)*size0); // boost::math::digamma<>(size0);
-				TrigammaSize = trigamma((i+1)*size0); // boost::math::digamma<>(size0);
-				for(int t=0; t<this->T; t++)
-				{
-					DigammaSizePlusX = digamma((i+1)*size0+this->obs[t]); //boost::math::digamma<>(size0+this->obs[ti]);
-					TrigammaSizePlusX = trigamma((i+1)*size0+this->obs[t]);
-					if(this->obs[t]==0)
-					{
-						F += weights[i+fromState][t] * (i+1) * logp;
-						//dFdSize+=0;
-					}
-					if(this->obs[t]!=0)
-					{
-						F += weights[i+fromState][t] * (i+1) * (logp - DigammaSize + DigammaSizePlusX);
-						dFdSize += weights[i+fromState][t] * pow((i+1),2) * (-TrigammaSize + TrigammaSizePlusX);
-					}
-				}
-			}
-			FdivM = F/dFdSize;
-			if (FdivM < size0)
-			{
-				size0 = size0-FdivM;
-			}
-			else if (FdivM >= size0)
-			{
-				size0 = size0/2.0;
-			}
-			if(fabs(F)<eps)
-			{
-				break;
-			}
+			size0 = size0/2.0;
+		}
+		if(fabs(F)<eps)
+		{
+			break;
 		}
 	}
 	this->size = size0;
@@ -717,78 +618,304 @@ void NegativeBinomial::update_constrained(double** weights, int fromState, int t
 double NegativeBinomial::fsize(double mean, double variance)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	return( mean*mean / (variance - mean) );
+	return( mean*mean / (variance - mean) );
+}
+
+double NegativeBinomial::fprob(double mean, double variance)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	return( mean / variance );
+}
+
+double NegativeBinomial::fmean(double size, double prob)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	return( size / prob - size );
+}
+
+double NegativeBinomial::fvariance(double size, double prob)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	return( (size - prob*size) / (prob*prob) );
+}
+
+// Getter and Setter ------------------------------------------
+double NegativeBinomial::get_mean()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	return( this->fmean( this->size, this->prob ) );
+}
+
+void NegativeBinomial::set_mean(double mean)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	double variance = this->get_variance();
+	this->size = this->fsize( mean, variance );
+	this->prob = this->fprob( mean, variance );
+}
+
+double NegativeBinomial::get_variance()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	return( this->fvariance( this->size, this->prob ) );
+}
+
+void NegativeBinomial::set_variance(double variance)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	double mean = this->get_mean();
+	this->size = this->fsize( mean, variance );
+	this->prob = this->fprob( mean, variance );
+}
+
+DensityName NegativeBinomial::get_name()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	return(this->name);
+}
+
+void NegativeBinomial::set_name(DensityName name)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->name = name;
+}
+
+void NegativeBinomial::set_observations(int* observations, int T)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->obs = observations;
+	this->T = T;
+}
+
+double NegativeBinomial::get_size()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	return(this->size);
+}
+
+double NegativeBinomial::get_prob()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	return(this->prob);
+}
+
+double* NegativeBinomial::get_lxfactorials()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	return(this->lxfactorials);
+}
+
+
+// ============================================================
+// Zero-inflated Negative Binomial density
+// ============================================================
+
+// Constructor and Destructor ---------------------------------
+ZiNB::ZiNB(int* observations, int T, double size, double prob, double w)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->name = ZERO_INFLATED_NEGATIVE_BINOMIAL;
+	this->obs = observations;
+	this->T = T;
+	this->w = w;
+	this->max_obs = 0;
+	if (this->obs != NULL)
+	{
+		this->max_obs = intMax(observations, T);
+	}
+	this->nb = new NegativeBinomial(observations, T, size, prob);
+}
+
+ZiNB::ZiNB(int* observations, int T, double size, double prob, double w, int max_obs, double* lxfactorials)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->name = ZERO_INFLATED_NEGATIVE_BINOMIAL;
+	this->obs = observations;
+	this->T = T;
+	this->w = w;
+	this->max_obs = max_obs;
+	this->nb = new NegativeBinomial(observations, T, size, prob, max_obs, lxfactorials);
+}
+
+ZiNB::~ZiNB()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	delete this->nb;
+}
+
+// Methods ----------------------------------------------------
+void ZiNB::calc_logdensities(double* logdens)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	double log1minusw = log(1-this->w);
+	this->nb->calc_logdensities(logdens);
+	for (int t=0; t<this->T; t++)
+	{
+		if (this->obs[t] == 0)
+		{
+			logdens[t] = log( this->w + (1-this->w) * exp(logdens[t]) );
+		}
+		else
+		{
+			logdens[t] = log1minusw + logdens[t];
+		}
+		//FILE_LOG(logDEBUG4) << "logdens["<<t<<"] = " << logdens[t];
+		if (std::isnan(logdens[t]))
+		{
+			//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
+			//FILE_LOG(logERROR) << "logdens["<<t<<"] = "<< logdens[t];
+			throw nan_detected;
+		}
+	}
+}
+
+void ZiNB::calc_densities_per_read(double* dens_per_read, int max_obs)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->nb->calc_densities_per_read(dens_per_read, max_obs);
+	for (int j=0; j<=max_obs; j++)
+	{
+		dens_per_read[j] *= 1-this->w;
+	}
+	dens_per_read[0] += this->w;
+	if (std::isnan(dens_per_read[0]))
+	{
+		//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
+		//FILE_LOG(logERROR) << "dens_per_read[0] = "<< dens_per_read[0];
+		throw nan_detected;
+	}
+}
+
+void ZiNB::update(double* weights)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	std::vector<double> weights_per_read(this->max_obs+1, 0.0);
+	for (int t=0; t<this->T; t++)
+	{
+		weights_per_read[this->obs[t]] += weights[t];
+	}
+	this->update_per_read(&weights_per_read[0]);
+}
+
+void ZiNB::update_per_read(double* weights_per_read)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->update_constrained_per_read(weights_per_read, 1);
+}
+
+void ZiNB::update_constrained(double** weights, int fromState, int toState)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	int num_states = toState-fromState;
+	std::vector<double> weights_per_read((size_t)num_states * (this->max_obs+1), 0.0);
+	for (int i=0; i<num_states; i++)
+	{
+		double* weights_i = &weights_per_read[(size_t)i * (this->max_obs+1)];
+		for (int t=0; t<this->T; t++)
+		{
+			weights_i[this->obs[t]] += weights[i+fromState][t];
+		}
+	}
+	this->update_constrained_per_read(&weights_per_read[0], num_states);
+}
+
+void ZiNB::update_constrained_per_read(double* weights_per_read, int num_states)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	// The zero counts of state i are split into excess zeros and zeros of its negative binomial with size (i+1)*size and the same prob.
+	// The excess zeros give the update of w, the remaining weights are the weights of the negative binomial update.
+	int ld = this->max_obs+1;
+	double logp = log(this->nb->get_prob());
+	double size = this->nb->get_size();
+	double sum_excess = 0.0, sum_weights = 0.0;
+	std::vector<double> weights_nb(weights_per_read, weights_per_read + (size_t)num_states * ld);
+	for (int i=0; i<num_states; i++)
+	{
+		double* weights_i = &weights_nb[(size_t)i * ld];
+		double nb0 = exp((i+1) * size * logp);
+		double excess = weights_i[0] * this->w / (this->w + (1-this->w) * nb0);
+		weights_i[0] -= excess;
+		sum_excess += excess;
+		for (int j=0; j<=this->max_obs; j++)
+		{
+			sum_weights += weights_per_read[(size_t)i * ld + j];
+		}
+	}
+	if (sum_weights > 0) // only update if not nan
+	{
+		this->w = sum_excess / sum_weights;
+	}
+	this->nb->update_constrained_per_read(&weights_nb[0], num_states);
+	//FILE_LOG(logDEBUG1) << "w = "<<this->w << ", size = "<<this->nb->get_size() << ", prob = "<<this->nb->get_prob();
 }
 
-double NegativeBinomial::fprob(double mean, double variance)
+// Getter and Setter ------------------------------------------
+double ZiNB::get_mean()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	return( mean / variance );
+	return(this->nb->get_mean());
 }
 
-double NegativeBinomial::fmean(double size, double prob)
+void ZiNB::set_mean(double mean)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	return( size / prob - size );
+	this->nb->set_mean(mean);
 }
 
-double NegativeBinomial::fvariance(double size, double prob)
+double ZiNB::get_variance()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	return( (size - prob*size) / (prob*prob) );
+	return(this->nb->get_variance());
 }
 
-// Getter and Setter ------------------------------------------
-double NegativeBinomial::get_mean()
+void ZiNB::set_variance(double variance)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	return( this->fmean( this->size, this->prob ) );
+	this->nb->set_variance(variance);
 }
 
-void NegativeBinomial::set_mean(double mean)
+DensityName ZiNB::get_name()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	double variance = this->get_variance();
-	this->size = this->fsize( mean, variance );
-	this->prob = this->fprob( mean, variance );
+	return(this->name);
 }
 
-double NegativeBinomial::get_variance()
+void ZiNB::set_name(DensityName name)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	return( this->fvariance( this->size, this->prob ) );
+	this->name = name;
 }
 
-void NegativeBinomial::set_variance(double variance)
+void ZiNB::set_observations(int* observations, int T)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	double mean = this->get_mean();
-	this->size = this->fsize( mean, variance );
-	this->prob = this->fprob( mean, variance );
+	this->obs = observations;
+	this->T = T;
+	this->nb->set_observations(observations, T);
 }
 
-DensityName NegativeBinomial::get_name()
+double ZiNB::get_size()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	return(this->name);
+	return(this->nb->get_size());
 }
 
-void NegativeBinomial::set_name(DensityName name)
+double ZiNB::get_prob()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	this->name = name;
+	return(this->nb->get_prob());
 }
 
-double NegativeBinomial::get_size()
+double ZiNB::get_w()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	return(this->size);
+	return(this->w);
 }
 
-double NegativeBinomial::get_prob()
+void ZiNB::set_w(double w)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	return(this->prob);
+	this->w = w;
 }
 
 
@@ -858,50 +985,23 @@ void Binomial::calc_logdensities(double* logdens)
 	}
 } 
 
-void Binomial::calc_densities(double* dens)
+void Binomial::calc_densities_per_read(double* dens_per_read, int max_obs)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	double logp = log(this->prob);
 	double log1minusp = log(1-this->prob);
-	// Select strategy for computing gammas
-	if (this->max_obs <= this->T)
-	{
-		//FILE_LOG(logDEBUG2) << "Precomputing densities in " << __func__ << " for every obs[t], because max(O)<=T";
-		std::vector<double> dens_per_read (this->max_obs+1);
-		for (int j=0; j<=this->max_obs; j++)
-		{
-			dens_per_read[j] = exp( lchoose(this->size, j) + j * logp + (this->size-j) * log1minusp );
-		}
-		for (int t=0; t<this->T; t++)
-		{
-			dens[t] = dens_per_read[(int) this->obs[t]];
-			//FILE_LOG(logDEBUG4) << "dens["<<t<<"] = " << dens[t];
-			if (std::isnan(dens[t]))
-			{
-				//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
-				//FILE_LOG(logERROR) << "dens["<<t<<"] = "<< dens[t];
-				throw nan_detected;
-			}
-		}
-	}
-	else
+	for (int j=0; j<=max_obs; j++)
 	{
-		//FILE_LOG(logDEBUG2) << "Computing densities in " << __func__ << " for every t, because max(O)>T";
-		int j;
-		for (int t=0; t<this->T; t++)
+		dens_per_read[j] = exp( lchoose(this->size, j) + j * logp + (this->size-j) * log1minusp );
+		//FILE_LOG(logDEBUG4) << "dens_per_read["<<j<<"] = " << dens_per_read[j];
+		if (std::isnan(dens_per_read[j]))
 		{
-			j = (int) this->obs[t];
-			dens[t] = exp( lchoose(this->size, j) + j * logp + (this->size-j) * log1minusp );
-			//FILE_LOG(logDEBUG4) << "dens["<<t<<"] = " << dens[t];
-			if (std::isnan(dens[t]))
-			{
-				//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
-				//FILE_LOG(logERROR) << "dens["<<t<<"] = "<< dens[t];
-				throw nan_detected;
-			}
+			//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
+			//FILE_LOG(logERROR) << "dens_per_read["<<j<<"] = "<< dens_per_read[j];
+			throw nan_detected;
 		}
 	}
-} 
+}
 
 void Binomial::update(double* weights)
 {
@@ -1187,6 +1287,13 @@ void Binomial::set_name(DensityName name)
 	this->name = name;
 }
 
+void Binomial::set_observations(int* observations, int T)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->obs = observations;
+	this->T = T;
+}
+
 double Binomial::get_size()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
@@ -1236,20 +1343,13 @@ void ZeroInflation::calc_logdensities(double* logdens)
 	}
 }
 
-void ZeroInflation::calc_densities(double* dens)
+void ZeroInflation::calc_densities_per_read(double* dens_per_read, int max_obs)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	for (int t=0; t<this->T; t++)
+	dens_per_read[0] = 1.0;
+	for (int j=1; j<=max_obs; j++)
 	{
-		if(obs[t]==0)
-		{
-			dens[t] = 1.0;
-		}
-		if(obs[t]>0)
-		{
-			dens[t] = 0.0;
-		}
-		//FILE_LOG(logDEBUG4) << "dens["<<t<<"] = " << dens[t];
+		dens_per_read[j] = 0.0;
 	}
 }
 
@@ -1272,6 +1372,13 @@ void ZeroInflation::set_name(DensityName name)
 	this->name = name;
 }
 
+void ZeroInflation::set_observations(int* observations, int T)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->obs = observations;
+	this->T = T;
+}
+
 double ZeroInflation::get_mean()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
@@ -1364,59 +1471,46 @@ void Geometric::calc_logdensities(double* logdens)
 	}
 } 
 
-void Geometric::calc_densities(double* dens)
+void Geometric::calc_densities_per_read(double* dens_per_read, int max_obs)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	double p = this->prob;
 	double oneminusp = 1-this->prob;
-	// Select strategy for computing gammas
-	if (this->max_obs <= this->T)
+	for (int j=0; j<=max_obs; j++)
 	{
-		//FILE_LOG(logDEBUG2) << "Precomputing densities in " << __func__ << " for every obs[t], because max(O)<=T";
-		std::vector<double> dens_per_read (this->max_obs+1);
-		for (int j=0; j<=this->max_obs; j++)
-		{
-			dens_per_read[j] = p * pow(oneminusp,j);
-		}
-		for (int t=0; t<this->T; t++)
+		dens_per_read[j] = p * pow(oneminusp,j);
+		//FILE_LOG(logDEBUG4) << "dens_per_read["<<j<<"] = " << dens_per_read[j];
+		if (std::isnan(dens_per_read[j]))
 		{
-			dens[t] = dens_per_read[(int) this->obs[t]];
-			//FILE_LOG(logDEBUG4) << "dens["<<t<<"] = " << dens[t];
-			if (std::isnan(dens[t]))
-			{
-				//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
-				//FILE_LOG(logERROR) << "dens["<<t<<"] = "<< dens[t];
-				throw nan_detected;
-			}
+			//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
+			//FILE_LOG(logERROR) << "dens_per_read["<<j<<"] = "<< dens_per_read[j];
+			throw nan_detected;
 		}
 	}
-	else
+}
+
+void Geometric::update(double* weights)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	// Sum the weights per read count, as in NegativeBinomial::update()
+	std::vector<double> weights_per_read(this->max_obs+1, 0.0);
+	for (int t=0; t<this->T; t++)
 	{
-		//FILE_LOG(logDEBUG2) << "Computing densities in " << __func__ << " for every t, because max(O)>T";
-		for (int t=0; t<this->T; t++)
-		{
-			dens[t] = p * pow(oneminusp,this->obs[t]);
-			//FILE_LOG(logDEBUG4) << "dens["<<t<<"] = " << dens[t];
-			if (std::isnan(dens[t]))
-			{
-				//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
-				//FILE_LOG(logERROR) << "dens["<<t<<"] = "<< dens[t];
-				throw nan_detected;
-			}
-		}
+		weights_per_read[this->obs[t]] += weights[t];
 	}
-} 
+	this->update_per_read(&weights_per_read[0]);
+}
 
-void Geometric::update(double* weights)
+void Geometric::update_per_read(double* weights_per_read)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	double numerator, denominator;
 	// Update prob (p)
 	numerator=denominator=0.0;
-	for (int t=0; t<this->T; t++)
+	for (int j=0; j<=this->max_obs; j++)
 	{
-		numerator += weights[t];
-		denominator += weights[t]*(1+this->obs[t]);
+		numerator += weights_per_read[j];
+		denominator += weights_per_read[j]*(1+j);
 	}
 	if (denominator > 0) // only update if not nan
 	{
@@ -1482,12 +1576,25 @@ void Geometric::set_name(DensityName name)
 	this->name = name;
 }
 
+void Geometric::set_observations(int* observations, int T)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->obs = observations;
+	this->T = T;
+}
+
 double Geometric::get_prob()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	return(this->prob);
 }
 
+void Geometric::set_prob(double prob)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->prob = prob;
+}
+
 
 // ============================================================
 // Multivariate Copula Approximation
@@ -1532,3 +1639,312 @@ void MVCopulaApproximation::set_name(DensityName name)
 }
 
 
+// ============================================================
+// Gaussian copula densities of combined states
+// ============================================================
+
+#define COPULA_SINGULAR 1e-15 ///< a correlation matrix is treated as singular if a squared pivot of its Cholesky decomposition is smaller, about the tolerance of solve() in R
+
+// Inverse and determinant of a symmetric positive definite matrix [n x n] by Cholesky decomposition, false if it is numerically singular
+static bool cholesky_inverse(const std::vector<double>& X, int n, std::vector<double>& inverse, double* determinant)
+{
+	std::vector<double> L(n*n, 0.0);
+	*determinant = 1.0;
+	for (int j=0; j<n; j++)
+	{
+		double d = X[j*n+j];
+		for (int k=0; k<j; k++)
+		{
+			d -= L[j*n+k] * L[j*n+k];
+		}
+		if (!(d > COPULA_SINGULAR))
+		{
+			return(false);
+		}
+		L[j*n+j] = sqrt(d);
+		*determinant *= d;
+		for (int i=j+1; i<n; i++)
+		{
+			double sum = X[i*n+j];
+			for (int k=0; k<j; k++)
+			{
+				sum -= L[i*n+k] * L[j*n+k];
+			}
+			L[i*n+j] = sum / L[j*n+j];
+		}
+	}
+	// inverse = L^-T * L^-1
+	std::vector<double> Linv(n*n, 0.0);
+	for (int j=0; j<n; j++)
+	{
+		Linv[j*n+j] = 1.0 / L[j*n+j];
+		for (int i=j+1; i<n; i++)
+		{
+			double sum = 0.0;
+			for (int k=j; k<i; k++)
+			{
+				sum -= L[i*n+k] * Linv[k*n+j];
+			}
+			Linv[i*n+j] = sum / L[i*n+i];
+		}
+	}
+	inverse.assign(n*n, 0.0);
+	for (int i=0; i<n; i++)
+	{
+		for (int j=0; j<n; j++)
+		{
+			for (int k=std::max(i,j); k<n; k++)
+			{
+				inverse[i*n+j] += Linv[k*n+i] * Linv[k*n+j];
+			}
+		}
+	}
+	return(true);
+}
+
+// Constructor ------------------------------------------------
+CopulaDensities::CopulaDensities(int* counts, int T, int Nmod, int num_uni_states, int num_comb_states, int* comb_uni_states)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	this->counts = counts;
+	this->T = T;
+	this->Nmod = Nmod;
+	this->num_uni_states = num_uni_states;
+	this->num_comb_states = num_comb_states;
+	this->comb_uni_states = comb_uni_states;
+	this->max_count = intMax(counts, T*Nmod);
+	this->z_per_count.assign((size_t)Nmod * num_uni_states * (this->max_count+1), 0.0);
+	this->dens_per_count.assign((size_t)Nmod * num_uni_states * (this->max_count+1), 0.0);
+	// Uncorrelated until estimate_correlations()
+	this->cor_matrix_inv_minus_I.assign((size_t)num_comb_states * Nmod * Nmod, 0.0);
+	this->normalization.assign(num_comb_states, 1.0);
+}
+
+// Methods ----------------------------------------------------
+void CopulaDensities::set_marginal(int imod, int istate, int distr_type, double size, double prob, double w)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	double* z = &this->z_per_count[this->table_index(imod, istate)];
+	double* dens = &this->dens_per_count[this->table_index(imod, istate)];
+	// qnorm(1) is infinite, such z-values are capped
+	double zmax = qnorm(1-1e-16, 0, 1, 1, 0);
+	for (int j=0; j<=this->max_count; j++)
+	{
+		double u;
+		if (distr_type == 1)
+		{
+			u = 1.0;
+			dens[j] = (j == 0) ? 1.0 : 0.0;
+		}
+		else if (distr_type == 2)
+		{
+			u = pgeom(j, prob, 1, 0);
+			dens[j] = dgeom(j, prob, 0);
+		}
+		else if (distr_type == 3)
+		{
+			u = pnbinom(j, size, prob, 1, 0);
+			dens[j] = dnbinom(j, size, prob, 0);
+		}
+		else if (distr_type == 4)
+		{
+			u = pbinom(j, size, prob, 1, 0);
+			dens[j] = dbinom(j, size, prob, 0);
+		}
+		else
+		{
+			// The zero-inflation adds w to the zeros
+			u = w + (1-w) * pnbinom(j, size, prob, 1, 0);
+			dens[j] = (1-w) * dnbinom(j, size, prob, 0);
+			if (j == 0) dens[j] += w;
+		}
+		z[j] = qnorm(u, 0, 1, 1, 0);
+		if (z[j] == INFINITY)
+		{
+			z[j] = zmax;
+		}
+	}
+}
+
+void CopulaDensities::estimate_correlations(int* comb_state_per_bin)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	int Nmod = this->Nmod;
+	// Means in a first pass and centered cross products in a second pass over the bins, as cor() in R
+	std::vector<int> num_bins(this->num_comb_states, 0);
+	std::vector<double> mean((size_t)this->num_comb_states * Nmod, 0.0);
+	for (int t=0; t<this->T; t++)
+	{
+		int icomb = comb_state_per_bin[t] - 1;
+		if (icomb < 0 || icomb >= this->num_comb_states) continue; // NA
+		num_bins[icomb]++;
+		for (int imod=0; imod<Nmod; imod++)
+		{
+			mean[icomb*Nmod + imod] += this->z_per_count[this->table_index(imod, this->uni_state(icomb, imod)) + this->counts[t + imod*this->T]];
+		}
+	}
+	for (int icomb=0; icomb<this->num_comb_states; icomb++)
+	{
+		for (int imod=0; imod<Nmod; imod++)
+		{
+			mean[icomb*Nmod + imod] /= std::max(num_bins[icomb], 1);
+		}
+	}
+	std::vector<double> cov((size_t)this->num_comb_states * Nmod * Nmod, 0.0);
+	std::vector<double> zt(Nmod);
+	for (int t=0; t<this->T; t++)
+	{
+		int icomb = comb_state_per_bin[t] - 1;
+		if (icomb < 0 || icomb >= this->num_comb_states) continue;
+		for (int imod=0; imod<Nmod; imod++)
+		{
+			zt[imod] = this->z_per_count[this->table_index(imod, this->uni_state(icomb, imod)) + this->counts[t + imod*this->T]] - mean[icomb*Nmod + imod];
+		}
+		double* cov_comb = &cov[(size_t)icomb*Nmod*Nmod];
+		for (int i=0; i<Nmod; i++)
+		{
+			for (int j=0; j<Nmod; j++)
+			{
+				cov_comb[i*Nmod+j] += zt[i] * zt[j];
+			}
+		}
+	}
+
+	std::vector<double> cor(Nmod*Nmod), inverse(Nmod*Nmod);
+	for (int icomb=0; icomb<this->num_comb_states; icomb++)
+	{
+		const double* cov_comb = &cov[(size_t)icomb*Nmod*Nmod];
+		// States with less than two bins or a constant z-value (no correlation defined) and singular correlation matrices are taken as uncorrelated
+		bool valid = num_bins[icomb] > 1;
+		for (int i=0; i<Nmod; i++)
+		{
+			if (!(cov_comb[i*Nmod+i] > 0)) valid = false;
+		}
+		double determinant = 1.0;
+		if (valid)
+		{
+			for (int i=0; i<Nmod; i++)
+			{
+				for (int j=0; j<Nmod; j++)
+				{
+					cor[i*Nmod+j] = cov_comb[i*Nmod+j] / sqrt(cov_comb[i*Nmod+i] * cov_comb[j*Nmod+j]);
+				}
+			}
+			valid = cholesky_inverse(cor, Nmod, inverse, &determinant);
+		}
+		double* Q = &this->cor_matrix_inv_minus_I[(size_t)icomb*Nmod*Nmod];
+		for (int i=0; i<Nmod; i++)
+		{
+			for (int j=0; j<Nmod; j++)
+			{
+				Q[i*Nmod+j] = valid ? inverse[i*Nmod+j] - (i == j ? 1.0 : 0.0) : 0.0;
+			}
+		}
+		this->normalization[icomb] = valid ? pow(determinant, -0.5) : 1.0;
+	}
+}
+
+void CopulaDensities::calc_densities(double* densities)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	int Nmod = this->Nmod;
+	// The densities depend only on the read counts of all modifications. If there are fewer combinations of read counts than time points,
+	// each combined state fills a table over all combinations and the time points look up their combination.
+	double num_combinations = pow((double)(this->max_count+1), Nmod);
+	bool tabulate = num_combinations <= this->T;
+	std::vector<int> combination;
+	std::vector<int> tuple_counts; // read counts of each combination, [num_combinations x Nmod]
+	int num_points = this->T;
+	if (tabulate)
+	{
+		num_points = (int) num_combinations;
+		combination.assign(this->T, 0);
+		for (int imod=Nmod-1; imod>=0; imod--)
+		{
+			for (int t=0; t<this->T; t++)
+			{
+				combination[t] = combination[t] * (this->max_count+1) + this->counts[t + imod*this->T];
+			}
+		}
+		tuple_counts.resize((size_t)num_points * Nmod);
+		for (int k=0; k<num_points; k++)
+		{
+			int rest = k;
+			for (int imod=0; imod<Nmod; imod++)
+			{
+				tuple_counts[(size_t)imod*num_points + k] = rest % (this->max_count+1);
+				rest /= (this->max_count+1);
+			}
+		}
+	}
+	const int* point_counts = tabulate ? &tuple_counts[0] : this->counts;
+
+	// One combined state per iteration, so that each thread writes a contiguous column
+	#pragma omp parallel for schedule(dynamic,1)
+	for (int icomb=0; icomb<this->num_comb_states; icomb++)
+	{
+		std::vector<const double*> z(Nmod), dens(Nmod);
+		std::vector<const int*> counts(Nmod);
+		for (int imod=0; imod<Nmod; imod++)
+		{
+			size_t index = this->table_index(imod, this->uni_state(icomb, imod));
+			z[imod] = &this->z_per_count[index];
+			dens[imod] = &this->dens_per_count[index];
+			counts[imod] = point_counts + (size_t)imod*num_points;
+		}
+		const double* Q = &this->cor_matrix_inv_minus_I[(size_t)icomb*Nmod*Nmod];
+		double normalization = this->normalization[icomb];
+		double* column = densities + (size_t)icomb*this->T;
+		std::vector<double> table(tabulate ? num_points : 0);
+		double* values = tabulate ? &table[0] : column;
+		std::vector<double> zt(Nmod);
+		for (int k=0; k<num_points; k++)
+		{
+			double product = 1.0;
+			for (int imod=0; imod<Nmod; imod++)
+			{
+				zt[imod] = z[imod][counts[imod][k]];
+				product *= dens[imod][counts[imod][k]];
+			}
+			double exponent = 0.0;
+			for (int j=0; j<Nmod; j++)
+			{
+				double zQ = 0.0;
+				for (int i=0; i<Nmod; i++)
+				{
+					zQ += zt[i] * Q[i*Nmod+j];
+				}
+				exponent += zQ * zt[j];
+			}
+			double d = product * normalization * exp(-0.5 * exponent);
+			// Densities above 1 are cut, NaN is kept so that the HMM reports it
+			if (d > 1) d = 1;
+			else if (d < 0) d = 0;
+			values[k] = d;
+		}
+		if (tabulate)
+		{
+			for (int t=0; t<this->T; t++)
+			{
+				column[t] = table[combination[t]];
+			}
+		}
+	}
+
+	// Time points where all densities are 0 get the densities of the previous time point
+	for (int t=0; t<this->T; t++)
+	{
+		double sum = 0.0;
+		for (int icomb=0; icomb<this->num_comb_states; icomb++)
+		{
+			sum += densities[(size_t)icomb*this->T + t];
+		}
+		if (sum == 0)
+		{
+			for (int icomb=0; icomb<this->num_comb_states; icomb++)
+			{
+				densities[(size_t)icomb*this->T + t] = (t == 0) ? 1e-10 : densities[(size_t)icomb*this->T + t-1];
+			}
+		}
+	}
+}
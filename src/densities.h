@@ -10,7 +10,7 @@
 #include <vector> // storing density functions in MVCopula
 
 enum whichvariate {UNIVARIATE, MULTIVARIATE};
-enum DensityName {ZERO_INFLATION, NORMAL, NEGATIVE_BINOMIAL, GEOMETRIC, POISSON, BINOMIAL, OTHER};
+enum DensityName {ZERO_INFLATION, NORMAL, NEGATIVE_BINOMIAL, GEOMETRIC, POISSON, BINOMIAL, ZERO_INFLATED_NEGATIVE_BINOMIAL, OTHER};
 
 class Density
 {
@@ -19,12 +19,13 @@ class Density
 		virtual ~Density() {};
 		// Methods
 		virtual void calc_logdensities(double*) {};
-		virtual void calc_densities(double*) {};
+		virtual void calc_densities_per_read(double*, int) {}; ///< densities of the read counts 0..max_obs, lookup by count instead of by time point
 		virtual void update(double*) {}; 
 		virtual void update_constrained(double**, int, int) {};
 		// Getter and Setter
 		virtual DensityName get_name() { return(OTHER); };
 		virtual void set_name(DensityName) {};
+		virtual void set_observations(int*, int) {}; ///< rebind to other observations, their maximum must not exceed the max_obs of the constructor because the tables of the counts are kept
 		virtual double get_mean() { return(0); };
 		virtual void set_mean(double) {};
 		virtual double get_variance() { return(0); };
@@ -41,13 +42,14 @@ class Normal : public Density
 		~Normal();
 
 		// Methods
-		void calc_densities(double* density);
+		void calc_densities_per_read(double* dens_per_read, int max_obs);
 		void calc_logdensities(double* logdensity);
 		void update(double* weights);
 
 		// Getter and Setter
 		DensityName get_name();
 		void set_name(DensityName name);
+		void set_observations(int* observations, int T);
 		double get_mean();
 		void set_mean(double mean);
 		double get_variance();
@@ -75,7 +77,8 @@ class Poisson : public Density
 		// Methods
 		DensityName get_name();
 		void set_name(DensityName name);
-		void calc_densities(double* density);
+		void set_observations(int* observations, int T);
+		void calc_densities_per_read(double* dens_per_read, int max_obs);
 		void calc_logdensities(double* logdensity);
 		void update(double* weights);
 		void update_constrained(double** weights, int fromState, int toState);
@@ -106,15 +109,19 @@ class NegativeBinomial : public Density
 	public:
 		// Constructor and Destructor
 		NegativeBinomial(int* observations, int T, double size, double prob);
+		NegativeBinomial(int* observations, int T, double size, double prob, int max_obs, double* lxfactorials);
 		~NegativeBinomial();
 
 		// Methods
 		DensityName get_name();
 		void set_name(DensityName name);
-		void calc_densities(double* density);
+		void set_observations(int* observations, int T);
+		void calc_densities_per_read(double* dens_per_read, int max_obs);
 		void calc_logdensities(double* logdensity);
 		void update(double* weights);
 		void update_constrained(double** weights, int fromState, int toState);
+		void update_per_read(double* weights_per_read); ///< update() with the weights summed per read count 0..max_obs
+		void update_constrained_per_read(double* weights_per_read, int num_states); ///< update_constrained() with the weights of each state summed per read count, a matrix [num_states x max_obs+1]
 		double fsize(double mean, double variance);
 		double fprob(double mean, double variance);
 		double fmean(double size, double prob);
@@ -127,6 +134,7 @@ class NegativeBinomial : public Density
 		void set_variance(double variance);
 		double get_size();
 		double get_prob();
+		double* get_lxfactorials();
 
 	private:
 		// Member variables
@@ -139,6 +147,48 @@ class NegativeBinomial : public Density
 		double variance; ///< variance of the negative binomial
 		int max_obs; ///< maximum observation
 		double* lxfactorials; ///< vector of precomputed factorials log(x!)
+		bool own_lxfactorials; ///< false if lxfactorials is shared with other densities and freed by its creator
+
+};
+
+
+class ZiNB : public Density
+{
+	public:
+		// Constructor and Destructor
+		ZiNB(int* observations, int T, double size, double prob, double w);
+		ZiNB(int* observations, int T, double size, double prob, double w, int max_obs, double* lxfactorials);
+		~ZiNB();
+
+		// Methods
+		DensityName get_name();
+		void set_name(DensityName name);
+		void set_observations(int* observations, int T);
+		void calc_densities_per_read(double* dens_per_read, int max_obs);
+		void calc_logdensities(double* logdensity);
+		void update(double* weights);
+		void update_constrained(double** weights, int fromState, int toState);
+		void update_per_read(double* weights_per_read); ///< update() with the weights summed per read count 0..max_obs
+		void update_constrained_per_read(double* weights_per_read, int num_states); ///< update_constrained() with the weights of each state summed per read count, a matrix [num_states x max_obs+1]
+
+		// Getter and Setter
+		double get_mean(); ///< mean of the negative binomial component
+		void set_mean(double mean);
+		double get_variance(); ///< variance of the negative binomial component
+		void set_variance(double variance);
+		double get_size();
+		double get_prob();
+		double get_w();
+		void set_w(double w);
+
+	private:
+		// Member variables
+		DensityName name; ///< name of the distribution
+		int T; ///< length of observation vector
+		int* obs; ///< vector [T] of observations
+		int max_obs; ///< maximum observation
+		double w; ///< probability of an excess zero
+		NegativeBinomial* nb; ///< negative binomial component, owns or shares lxfactorials
 
 };
 
@@ -153,7 +203,8 @@ class Binomial : public Density
 		// Methods
 		DensityName get_name();
 		void set_name(DensityName name);
-		void calc_densities(double* density);
+		void set_observations(int* observations, int T);
+		void calc_densities_per_read(double* dens_per_read, int max_obs);
 		void calc_logdensities(double* logdensity);
 		void update(double* weights);
 		void update_constrained(double** weights, int fromState, int toState);
@@ -195,7 +246,8 @@ class ZeroInflation : public Density
 		// Methods
 		DensityName get_name();
 		void set_name(DensityName name);
-		void calc_densities(double* density);
+		void set_observations(int* observations, int T);
+		void calc_densities_per_read(double* dens_per_read, int max_obs);
 		void calc_logdensities(double* logdensity);
 		void update(double* weights);
 
@@ -222,9 +274,11 @@ class Geometric : public Density
 		// Methods
 		DensityName get_name();
 		void set_name(DensityName name);
-		void calc_densities(double* density);
+		void set_observations(int* observations, int T);
+		void calc_densities_per_read(double* dens_per_read, int max_obs);
 		void calc_logdensities(double* logdensity);
 		void update(double* weights);
+		void update_per_read(double* weights_per_read); ///< update() with the weights summed per read count 0..max_obs
 		double fprob(double mean, double variance);
 		double fmean(double prob);
 		double fvariance(double prob);
@@ -235,6 +289,7 @@ class Geometric : public Density
 		double get_variance();
 		void set_variance(double variance);
 		double get_prob();
+		void set_prob(double prob);
 
 	private:
 		// Member variables
@@ -273,4 +328,35 @@ class MVCopulaApproximation : public Density {
 };
 
 
+/* Gaussian copula densities of the combined states of a multivariate HMM, e.g. one univariate state per strand in bivariate.findCNVs().
+ * The marginals depend only on the read count, so z = qnorm(cdf) and the marginal densities are tabulated per read count and looked up per bin. */
+class CopulaDensities
+{
+	public:
+		// Constructor and Destructor
+		CopulaDensities(int* counts, int T, int Nmod, int num_uni_states, int num_comb_states, int* comb_uni_states);
+
+		// Methods
+		void set_marginal(int imod, int istate, int distr_type, double size, double prob, double w); ///< tabulate one univariate state of modification imod, distr_type as in univariate_hmm() (1=delta, 2=geometric, 3=negative binomial, 4=binomial, 5=zero-inflated negative binomial with weight w). Calls Rmath, so only from the main R thread
+		void estimate_correlations(int* comb_state_per_bin); ///< correlation of the z-values of each combined state over the bins assigned to it, the identity if it cannot be inverted
+		void calc_densities(double* densities); ///< matrix [T x num_comb_states] with the time points of one state contiguous (as an R matrix)
+
+	private:
+		// Member variables
+		int* counts; ///< matrix [T x Nmod] of read counts, the time points of one modification are contiguous (as an R matrix)
+		int T; ///< length of observation vector
+		int Nmod; ///< number of modifications
+		int num_uni_states; ///< number of univariate states per modification
+		int num_comb_states; ///< number of combined states
+		int* comb_uni_states; ///< matrix [num_comb_states x Nmod] of univariate states (1-based) of each combined state, as an R matrix
+		int max_count; ///< maximum read count
+		std::vector<double> z_per_count; ///< [Nmod x num_uni_states x max_count+1] z-values per read count
+		std::vector<double> dens_per_count; ///< [Nmod x num_uni_states x max_count+1] marginal densities per read count
+		std::vector<double> cor_matrix_inv_minus_I; ///< [num_comb_states x Nmod x Nmod] inverse of the correlation matrix minus the identity
+		std::vector<double> normalization; ///< [num_comb_states] determinant of the correlation matrix to the power of -1/2
+		inline int uni_state(int icomb, int imod) { return(this->comb_uni_states[icomb + imod*this->num_comb_states] - 1); }
+		inline size_t table_index(int imod, int istate) { return(((size_t)imod*this->num_uni_states + istate) * (this->max_count+1)); }
+};
+
+
 #endif
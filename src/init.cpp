@@ -3,23 +3,27 @@
 #include "R_interface.h"
 
 
-R_NativePrimitiveArgType arg1[] = {INTSXP, INTSXP, INTSXP, INTSXP, REALSXP, REALSXP, INTSXP, INTSXP, REALSXP, INTSXP, REALSXP, REALSXP, REALSXP, REALSXP, INTSXP, REALSXP, REALSXP, REALSXP, REALSXP, LGLSXP, INTSXP, INTSXP, INTSXP, INTSXP};
-R_NativePrimitiveArgType arg2[] = {REALSXP, INTSXP, INTSXP, INTSXP, INTSXP, INTSXP, INTSXP, REALSXP, INTSXP, REALSXP, REALSXP, REALSXP, REALSXP, REALSXP, LGLSXP, INTSXP, INTSXP, INTSXP};
-R_NativePrimitiveArgType arg4[] = {INTSXP};
+R_NativePrimitiveArgType arg1[] = {INTSXP, INTSXP, INTSXP, INTSXP, REALSXP, REALSXP, INTSXP, INTSXP, REALSXP, INTSXP, REALSXP, REALSXP, REALSXP, REALSXP, INTSXP, REALSXP, REALSXP, REALSXP, REALSXP, LGLSXP, INTSXP, INTSXP, INTSXP, INTSXP, INTSXP, INTSXP, INTSXP, REALSXP, REALSXP, LGLSXP};
 
 static const R_CMethodDef CEntries[]  = {
-    {"C_univariate_hmm", (DL_FUNC) &univariate_hmm, 24, arg1},
-    {"C_multivariate_hmm", (DL_FUNC) &multivariate_hmm, 18, arg2},
-    {"C_univariate_cleanup", (DL_FUNC) &univariate_cleanup, 0, NULL},
-    {"C_multivariate_cleanup", (DL_FUNC) &multivariate_cleanup, 1, arg4},
+    {"C_univariate_hmm", (DL_FUNC) &univariate_hmm, 30, arg1},
     {NULL, NULL, 0, NULL}
 };
 
+static const R_CallMethodDef CallEntries[]  = {
+    {"C_univariate_hmm_batch", (DL_FUNC) &univariate_hmm_batch, 2},
+    {"C_univariate_decode", (DL_FUNC) &univariate_decode, 4},
+    {"C_multivariate_densities", (DL_FUNC) &multivariate_densities, 8},
+    {"C_multivariate_hmm", (DL_FUNC) &multivariate_hmm, 4},
+    {"C_special_function_tables", (DL_FUNC) &special_function_tables, 2},
+    {NULL, NULL, 0}
+};
+
 
 extern "C" {
 void R_init_AneuFinder(DllInfo *dll)
 {
-	R_registerRoutines(dll, CEntries, NULL, NULL, NULL);
+	R_registerRoutines(dll, CEntries, CallEntries, NULL, NULL);
 	R_useDynamicSymbols(dll, FALSE);
 // 	R_forceSymbols(dll, TRUE);
 }
@@ -0,0 +1,228 @@
+
+
+
+#include "kernels.h"
+
+// Vector kernels are only compiled where the compiler can target them per function and check the CPU at runtime
+#if (defined __GNUC__ || defined __clang__) && (defined __x86_64__ || defined __i386__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// ============================================================
+// Portable fallback
+// ============================================================
+static void matvec_scalar(const double* x, const double* M, int ld, int N, double* y)
+{
+	for (int i=0; i<ld; i++)
+	{
+		y[i] = 0.0;
+	}
+	for (int j=0; j<N; j++)
+	{
+		const double xj = x[j];
+		const double* Mj = M + (size_t)j*ld;
+		for (int i=0; i<ld; i++)
+		{
+			y[i] += xj * Mj[i];
+		}
+	}
+}
+
+// The maximum starts with the product of the first row, N >= 1. Only a strictly larger product replaces it, so ties keep the smallest index.
+static void maxvec_scalar(const double* x, const double* M, int ld, int N, double* y, int* index)
+{
+	for (int i=0; i<ld; i++)
+	{
+		y[i] = x[0] * M[i];
+		index[i] = 0;
+	}
+	for (int j=1; j<N; j++)
+	{
+		const double xj = x[j];
+		const double* Mj = M + (size_t)j*ld;
+		for (int i=0; i<ld; i++)
+		{
+			const double product = xj * Mj[i];
+			if (product > y[i])
+			{
+				y[i] = product;
+				index[i] = j;
+			}
+		}
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+// ============================================================
+// AVX2 (4 doubles per register)
+// ============================================================
+__attribute__((target("avx2,fma")))
+static void matvec_avx2(const double* x, const double* M, int ld, int N, double* y)
+{
+	// ld is a multiple of 8, so each block of 8 output values is held in two registers over the whole j-loop
+	for (int i=0; i<ld; i+=8)
+	{
+		__m256d acc0 = _mm256_setzero_pd();
+		__m256d acc1 = _mm256_setzero_pd();
+		for (int j=0; j<N; j++)
+		{
+			const __m256d xj = _mm256_set1_pd(x[j]);
+			const double* Mj = M + (size_t)j*ld + i;
+			acc0 = _mm256_fmadd_pd(xj, _mm256_loadu_pd(Mj), acc0);
+			acc1 = _mm256_fmadd_pd(xj, _mm256_loadu_pd(Mj+4), acc1);
+		}
+		_mm256_storeu_pd(y+i, acc0);
+		_mm256_storeu_pd(y+i+4, acc1);
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void maxvec_avx2(const double* x, const double* M, int ld, int N, double* y, int* index)
+{
+	// Indices are carried as doubles next to the maxima, they are exact for any number of states
+	double jmax[8];
+	for (int i=0; i<ld; i+=8)
+	{
+		const __m256d x0 = _mm256_set1_pd(x[0]);
+		__m256d acc0 = _mm256_mul_pd(x0, _mm256_loadu_pd(M + i));
+		__m256d acc1 = _mm256_mul_pd(x0, _mm256_loadu_pd(M + i+4));
+		__m256d arg0 = _mm256_setzero_pd();
+		__m256d arg1 = _mm256_setzero_pd();
+		for (int j=1; j<N; j++)
+		{
+			const __m256d xj = _mm256_set1_pd(x[j]);
+			const __m256d jd = _mm256_set1_pd((double) j);
+			const double* Mj = M + (size_t)j*ld + i;
+			const __m256d product0 = _mm256_mul_pd(xj, _mm256_loadu_pd(Mj));
+			const __m256d product1 = _mm256_mul_pd(xj, _mm256_loadu_pd(Mj+4));
+			const __m256d larger0 = _mm256_cmp_pd(product0, acc0, _CMP_GT_OQ);
+			const __m256d larger1 = _mm256_cmp_pd(product1, acc1, _CMP_GT_OQ);
+			acc0 = _mm256_blendv_pd(acc0, product0, larger0);
+			acc1 = _mm256_blendv_pd(acc1, product1, larger1);
+			arg0 = _mm256_blendv_pd(arg0, jd, larger0);
+			arg1 = _mm256_blendv_pd(arg1, jd, larger1);
+		}
+		_mm256_storeu_pd(y+i, acc0);
+		_mm256_storeu_pd(y+i+4, acc1);
+		_mm256_storeu_pd(jmax, arg0);
+		_mm256_storeu_pd(jmax+4, arg1);
+		for (int k=0; k<8; k++)
+		{
+			index[i+k] = (int) jmax[k];
+		}
+	}
+}
+
+// ============================================================
+// AVX-512 (8 doubles per register)
+// ============================================================
+__attribute__((target("avx512f")))
+static void matvec_avx512(const double* x, const double* M, int ld, int N, double* y)
+{
+	int i = 0;
+	// Two registers for the common case of 9 to 16 states
+	for (; i+16<=ld; i+=16)
+	{
+		__m512d acc0 = _mm512_setzero_pd();
+		__m512d acc1 = _mm512_setzero_pd();
+		for (int j=0; j<N; j++)
+		{
+			const __m512d xj = _mm512_set1_pd(x[j]);
+			const double* Mj = M + (size_t)j*ld + i;
+			acc0 = _mm512_fmadd_pd(xj, _mm512_loadu_pd(Mj), acc0);
+			acc1 = _mm512_fmadd_pd(xj, _mm512_loadu_pd(Mj+8), acc1);
+		}
+		_mm512_storeu_pd(y+i, acc0);
+		_mm512_storeu_pd(y+i+8, acc1);
+	}
+	for (; i<ld; i+=8)
+	{
+		__m512d acc = _mm512_setzero_pd();
+		for (int j=0; j<N; j++)
+		{
+			acc = _mm512_fmadd_pd(_mm512_set1_pd(x[j]), _mm512_loadu_pd(M + (size_t)j*ld + i), acc);
+		}
+		_mm512_storeu_pd(y+i, acc);
+	}
+}
+
+__attribute__((target("avx512f")))
+static void maxvec_avx512(const double* x, const double* M, int ld, int N, double* y, int* index)
+{
+	// Indices are carried as doubles next to the maxima, they are exact for any number of states
+	double jmax[8];
+	for (int i=0; i<ld; i+=8)
+	{
+		__m512d acc = _mm512_mul_pd(_mm512_set1_pd(x[0]), _mm512_loadu_pd(M + i));
+		__m512d arg = _mm512_setzero_pd();
+		for (int j=1; j<N; j++)
+		{
+			const __m512d product = _mm512_mul_pd(_mm512_set1_pd(x[j]), _mm512_loadu_pd(M + (size_t)j*ld + i));
+			const __mmask8 larger = _mm512_cmp_pd_mask(product, acc, _CMP_GT_OQ);
+			acc = _mm512_mask_mov_pd(acc, larger, product);
+			arg = _mm512_mask_mov_pd(arg, larger, _mm512_set1_pd((double) j));
+		}
+		_mm512_storeu_pd(y+i, acc);
+		_mm512_storeu_pd(jmax, arg);
+		for (int k=0; k<8; k++)
+		{
+			index[i+k] = (int) jmax[k];
+		}
+	}
+}
+#endif
+
+// ============================================================
+// Runtime dispatch
+// ============================================================
+KernelType select_kernel_type()
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		return(KERNEL_AVX512);
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		return(KERNEL_AVX2);
+	}
+#endif
+	return(KERNEL_SCALAR);
+}
+
+MatVecKernel get_matvec_kernel(KernelType type)
+{
+#ifdef HAVE_X86_KERNELS
+	if (type == KERNEL_AVX512)
+	{
+		return(&matvec_avx512);
+	}
+	if (type == KERNEL_AVX2)
+	{
+		return(&matvec_avx2);
+	}
+#else
+	(void)type;
+#endif
+	return(&matvec_scalar);
+}
+
+
+MaxVecKernel get_maxvec_kernel(KernelType type)
+{
+#ifdef HAVE_X86_KERNELS
+	if (type == KERNEL_AVX512)
+	{
+		return(&maxvec_avx512);
+	}
+	if (type == KERNEL_AVX2)
+	{
+		return(&maxvec_avx2);
+	}
+#else
+	(void)type;
+#endif
+	return(&maxvec_scalar);
+}
@@ -0,0 +1,24 @@
+
+
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "utility.h" // AlignedLength()
+
+/* Kernel for the matrix-vector product in the forward and backward recursions:
+ * y[i] = sum_j x[j] * M[j][i] for i < ld, where M is stored row-wise with leading dimension ld = AlignedLength(N) and zero padding.
+ * The rows of M are streamed contiguously, so forward() calls it with A and backward() with the transpose of A. */
+typedef void (*MatVecKernel)(const double* x, const double* M, int ld, int N, double* y);
+
+/* Max-product variant for the Viterbi recursion: y[i] = max_j x[j] * M[j][i] and index[i] = the smallest j that attains it, for i < ld.
+ * x and M must be non-negative. */
+typedef void (*MaxVecKernel)(const double* x, const double* M, int ld, int N, double* y, int* index);
+
+enum KernelType {KERNEL_SCALAR, KERNEL_AVX2, KERNEL_AVX512};
+
+KernelType select_kernel_type();
+MatVecKernel get_matvec_kernel(KernelType type);
+MaxVecKernel get_maxvec_kernel(KernelType type);
+
+#endif
@@ -501,7 +501,6 @@ void LogHMM::calc_sumxi()
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 // 	clock_t time = clock(), dtime;
 
-	double logxi;
 	// Initialize the sumxi
 	for (int iN=0; iN<this->N; iN++)
 	{
@@ -523,7 +522,7 @@ void LogHMM::calc_sumxi()
 			{
 				for (int jN=0; jN<this->N; jN++)
 				{
-					logxi = this->logalpha[t][iN] + this->logA[iN][jN] + this->logdensities[jN][t+1] + this->logbeta[t+1][jN] - this->logP;
+					double logxi = this->logalpha[t][iN] + this->logA[iN][jN] + this->logdensities[jN][t+1] + this->logbeta[t+1][jN] - this->logP;
 					this->sumxi[iN][jN] += exp( logxi );
 				}
 			}
@@ -3,6 +3,179 @@
 
 #include "scalehmm.h"
 
+// SQUAREM settings (Varadhan and Roland 2008), the step length is doubled after a successful maximal step and halved after a failed one
+#define SQUAREM_STEPMAX_INITIAL 4.0 ///< initial maximum step length, 1 is a plain EM update
+#define SQUAREM_STEP_FACTOR 2.0 ///< factor by which the maximum step length is changed
+#define SQUAREM_BACKTRACK 5 ///< maximum number of halvings of a step that gives non-finite parameters
+#define SQUAREM_FLOOR 1e-100 ///< probabilities are floored to this value, smaller values would make forward() and backward() run into subnormal numbers
+
+// A run of n+1 identical observations costs about 3*N^2*n operations bin by bin and about 4*N^3*log2(n) with matrix powers
+#define RUN_COST_RATIO 2.0 ///< runs are stepped over with matrix powers if n > RUN_COST_RATIO * N * log2(n)
+
+#define PRUNE_MIN_ITERATION 3 ///< states are pruned from this EM iteration on, the posteriors of the first iterations still depend on the initial transition probabilities
+
+// ============================================================
+// Exceptions must not leave a #pragma omp region, the threads record them per chain and the caller rethrows after the loop
+// ============================================================
+enum ThreadError {THREAD_OK, THREAD_NAN, THREAD_BAD_ALLOC, THREAD_FAILED};
+
+// Call from a catch block only, classifies the exception that is being handled
+static ThreadError current_thread_error()
+{
+	try
+	{
+		throw;
+	}
+	catch(std::bad_alloc& e)
+	{
+		return THREAD_BAD_ALLOC;
+	}
+	catch(std::exception& e)
+	{
+		if (strcmp(e.what(),"nan detected")==0) { return THREAD_NAN; }
+		return THREAD_FAILED;
+	}
+	catch(...)
+	{
+		return THREAD_FAILED;
+	}
+}
+
+static void rethrow_thread_errors(const std::vector<int>& thread_error)
+{
+	for (size_t i=0; i<thread_error.size(); i++)
+	{
+		if (thread_error[i] == THREAD_NAN) { throw nan_detected; }
+		if (thread_error[i] == THREAD_BAD_ALLOC) { throw std::bad_alloc(); }
+		if (thread_error[i] == THREAD_FAILED) { throw std::runtime_error("error in parallel region"); }
+	}
+}
+
+// Without OpenMP the code runs serially in thread 0
+static int thread_num()
+{
+#ifdef _OPENMP
+	return(omp_get_thread_num());
+#else
+	return(0);
+#endif
+}
+
+static int max_threads()
+{
+#ifdef _OPENMP
+	return(omp_get_max_threads());
+#else
+	return(1);
+#endif
+}
+
+// ============================================================
+// Dense products of [N x ld] matrices for the matrix powers
+// ============================================================
+// Z = X * Y, Z must not overlap X or Y
+static void matmul(const double* X, const double* Y, int N, int ld, double* Z)
+{
+	for (int i=0; i<N; i++)
+	{
+		double* Zi = Z + (size_t)i*ld;
+		for (int j=0; j<ld; j++)
+		{
+			Zi[j] = 0.0;
+		}
+		for (int k=0; k<N; k++)
+		{
+			const double Xik = X[(size_t)i*ld + k];
+			const double* Yk = Y + (size_t)k*ld;
+			for (int j=0; j<ld; j++)
+			{
+				Zi[j] += Xik * Yk[j];
+			}
+		}
+	}
+}
+
+// Scale X to a maximum of 1 and return the log of the scaling
+static double scale_to_max(double* X, int N, int ld)
+{
+	double maximum = 0.0;
+	for (size_t i=0; i<(size_t)N*ld; i++)
+	{
+		maximum = std::max(maximum, X[i]);
+	}
+	for (size_t i=0; i<(size_t)N*ld; i++)
+	{
+		X[i] /= maximum;
+	}
+	return(log(maximum));
+}
+
+// ============================================================
+// Kronecker-structured transition matrices
+// ============================================================
+// y = (X1 x X2)^T x for X1 [N1 x N1] and X2 [N2 x N2], i.e. y[i1*N2+i2] = sum_j1 sum_j2 x[j1*N2+j2] * X1[j1][i1] * X2[j2][i2], in O(N1*N2*(N1+N2)) instead of O((N1*N2)^2)
+// X1t is the transpose of X1 and X2 is X2, both with zero-padded rows for the kernel. scratch needs room for (N1+1) * AlignedLength(N2) values.
+static void kron_vecmat(MatVecKernel matvec, const double* x, const double* X1t, const double* X2, int N1, int N2, double* scratch, double* y)
+{
+	int ld1 = AlignedLength(N1);
+	int ld2 = AlignedLength(N2);
+	// scratch[j1][i2] = sum_j2 x[j1][j2] * X2[j2][i2]
+	for (int j1=0; j1<N1; j1++)
+	{
+		matvec(x + (size_t)j1*N2, X2, ld2, N2, scratch + (size_t)j1*ld2);
+	}
+	// y[i1][i2] = sum_j1 X1[j1][i1] * scratch[j1][i2], the kernel writes a padded row
+	double* row = scratch + (size_t)N1*ld2;
+	for (int i1=0; i1<N1; i1++)
+	{
+		matvec(X1t + (size_t)i1*ld1, scratch, ld2, N1, row);
+		double* y_i1 = y + (size_t)i1*N2;
+		for (int i2=0; i2<N2; i2++)
+		{
+			y_i1[i2] = row[i2];
+		}
+	}
+}
+
+// Copy the [n x n] matrix X (transposed if transpose) into rows of AlignedLength(n) with zero padding
+static void pad_rows(const std::vector<double>& X, int n, bool transpose, std::vector<double>& padded)
+{
+	int ld = AlignedLength(n);
+	padded.assign((size_t)n*ld, 0.0);
+	for (int i=0; i<n; i++)
+	{
+		for (int j=0; j<n; j++)
+		{
+			padded[(size_t)i*ld + j] = transpose ? X[(size_t)j*n + i] : X[(size_t)i*n + j];
+		}
+	}
+}
+
+// M-step for one factor [n x n] from its summed xi values, rows without xi values are kept
+static void update_factor(std::vector<double>& X, const std::vector<double>& sumxi, int n)
+{
+	for (int i=0; i<n; i++)
+	{
+		double rowsum = 0.0;
+		for (int j=0; j<n; j++)
+		{
+			rowsum += sumxi[(size_t)i*n + j];
+		}
+		if (rowsum == 0)
+		{
+			continue;
+		}
+		for (int j=0; j<n; j++)
+		{
+			X[(size_t)i*n + j] = sumxi[(size_t)i*n + j] / rowsum;
+			if (std::isnan(X[(size_t)i*n + j]))
+			{
+				throw nan_detected;
+			}
+		}
+	}
+}
+
 // ============================================================
 // Hidden Markov Model implemented with scaling strategy
 // ============================================================
@@ -10,69 +183,151 @@
 // Public =====================================================
 
 // Constructor and Destructor ---------------------------------
-ScaleHMM::ScaleHMM(int T, int N)
+ScaleHMM::ScaleHMM(int* observations, int T, int N, MatrixLayout layout, MemoryMode memory)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	//FILE_LOG(logDEBUG2) << "Initializing univariate ScaleHMM";
 	this->xvariate = UNIVARIATE;
 	this->T = T;
 	this->N = N;
-	this->A = CallocDoubleMatrix(N, N);
+	this->N_full = N;
+	this->prune_threshold = 0;
+	this->pruned.assign(N, 0);
+	for (int iN=0; iN<N; iN++)
+	{
+		this->active_state.push_back(iN);
+		this->state_position.push_back(iN);
+	}
+	this->density_matrix = NULL;
+	this->kron_N1 = 0;
+	this->kron_N2 = 0;
+	this->A = CallocAlignedDoubleMatrix(N, N);
+	this->At = CallocAlignedDoubleMatrix(N, N);
+	this->matvec = get_matvec_kernel(select_kernel_type());
+	this->maxvec = get_maxvec_kernel(select_kernel_type());
 	this->scalefactoralpha = (double*) Calloc(T, double);
-	this->scalealpha = CallocDoubleMatrix(T, N);
-	this->scalebeta = CallocDoubleMatrix(T, N);
-	this->densities = CallocDoubleMatrix(N, T);
+	// Observations are capped, so one table row per read count is much smaller than one column per time point
+	this->obs = observations;
+	this->max_obs = intMax(observations, T);
+	this->num_segments = 1;
+	this->segment_start.push_back(0);
+	this->segment_start.push_back(T);
+	this->T_capacity = T;
+	this->scalealpha = NULL;
+	this->scalealpha_capacity = 0;
+	this->alphablock = NULL;
+	this->alphablock_capacity = 0;
+	this->allocate_forward_backward(layout, memory);
+	this->densities = CallocAlignedDoubleMatrix(this->max_obs+1, N);
 // 	this->tdensities = CallocDoubleMatrix(T, N);
 	this->proba = (double*) Calloc(N, double);
-	this->gamma = CallocDoubleMatrix(N, T);
+	this->gamma = CallocAlignedDoubleMatrix(N, T);
 	this->sumgamma = (double*) Calloc(N, double);
-	this->sumxi = CallocDoubleMatrix(N, N);
+	this->sumxi = CallocAlignedDoubleMatrix(N, N);
 	this->logP = -INFINITY;
 	this->dlogP = INFINITY;
 	this->sumdiff_state_last = 0;
 	this->sumdiff_posterior = 0.0;
+	this->posterior_diff = false;
+	this->EMTime_real = 0;
+	this->EMiteration = 0;
+	this->quiet = false;
+	this->interruptible = true;
+	this->accelerate = false;
+	this->iteration_limit = -1;
+	this->has_iteration_limit = false;
+	this->squarem_phase = 0;
+	this->squarem_pending = false;
+	this->squarem_logP = -INFINITY;
+	this->squarem_alpha = 1;
+	this->squarem_stepmax = SQUAREM_STEPMAX_INITIAL;
+	this->runs_lumped = false;
+	this->viterbi_logP = -INFINITY;
 // 	this->use_tdens = false;
 
 }
 
 
-ScaleHMM::ScaleHMM(int T, int N, int Nmod, double** densities)
+ScaleHMM::ScaleHMM(int T, int N, int Nmod, const double* densities, MatrixLayout layout, MemoryMode memory)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	//FILE_LOG(logDEBUG2) << "Initializing multivariate ScaleHMM";
 	this->xvariate = MULTIVARIATE;
 	this->T = T;
 	this->N = N;
-	this->A = CallocDoubleMatrix(N, N);
+	this->N_full = N;
+	this->prune_threshold = 0;
+	this->pruned.assign(N, 0);
+	for (int iN=0; iN<N; iN++)
+	{
+		this->active_state.push_back(iN);
+		this->state_position.push_back(iN);
+	}
+	this->density_matrix = densities;
+	for (int iN=0; iN<N; iN++)
+	{
+		this->density_column.push_back(densities + (size_t)iN * T);
+	}
+	this->kron_N1 = 0;
+	this->kron_N2 = 0;
+	this->A = CallocAlignedDoubleMatrix(N, N);
+	this->At = CallocAlignedDoubleMatrix(N, N);
+	this->matvec = get_matvec_kernel(select_kernel_type());
+	this->maxvec = get_maxvec_kernel(select_kernel_type());
 	this->scalefactoralpha = (double*) Calloc(T, double);
-	this->scalealpha = CallocDoubleMatrix(T, N);
-	this->scalebeta = CallocDoubleMatrix(T, N);
-	this->densities = densities;
+	this->obs = NULL;
+	this->max_obs = 0;
+	this->num_segments = 1;
+	this->segment_start.push_back(0);
+	this->segment_start.push_back(T);
+	this->T_capacity = T;
+	this->scalealpha = NULL;
+	this->scalealpha_capacity = 0;
+	this->alphablock = NULL;
+	this->alphablock_capacity = 0;
+	this->allocate_forward_backward(layout, memory);
+	this->densities = NULL;
 	this->proba = (double*) Calloc(N, double);
-	this->gamma = CallocDoubleMatrix(N, T);
+	this->gamma = CallocAlignedDoubleMatrix(N, T);
 	this->sumgamma = (double*) Calloc(N, double);
-	this->sumxi = CallocDoubleMatrix(N, N);
+	this->sumxi = CallocAlignedDoubleMatrix(N, N);
 	this->logP = -INFINITY;
 	this->dlogP = INFINITY;
 	this->Nmod = Nmod;
+	this->sumdiff_posterior = 0.0;
+	this->posterior_diff = false;
+	this->EMTime_real = 0;
+	this->EMiteration = 0;
+	this->quiet = false;
+	this->interruptible = true;
+	this->accelerate = false;
+	this->iteration_limit = -1;
+	this->has_iteration_limit = false;
+	this->squarem_phase = 0;
+	this->squarem_pending = false;
+	this->squarem_logP = -INFINITY;
+	this->squarem_alpha = 1;
+	this->squarem_stepmax = SQUAREM_STEPMAX_INITIAL;
+	this->runs_lumped = false;
+	this->viterbi_logP = -INFINITY;
 
 }
 
 ScaleHMM::~ScaleHMM()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-	FreeDoubleMatrix(this->A, this->N);
+	FreeAlignedDoubleMatrix(this->A);
+	FreeAlignedDoubleMatrix(this->At);
 	Free(this->scalefactoralpha);
-	FreeDoubleMatrix(this->scalealpha, this->T);
-	FreeDoubleMatrix(this->scalebeta, this->T);
+	this->free_forward_backward();
 // 	FreeDoubleMatrix(this->tdensities, this->T);
-	FreeDoubleMatrix(this->gamma, this->N);
-	FreeDoubleMatrix(this->sumxi, this->N);
+	FreeAlignedDoubleMatrix(this->gamma);
+	FreeAlignedDoubleMatrix(this->sumxi);
 	Free(this->proba);
 	Free(this->sumgamma);
 	if (this->xvariate == UNIVARIATE)
 	{
-		FreeDoubleMatrix(this->densities, this->N);
+		FreeAlignedDoubleMatrix(this->densities);
 		for (int iN=0; iN<this->N; iN++)
 		{
 			//FILE_LOG(logDEBUG1) << "Deleting density functions"; 
@@ -82,6 +337,91 @@ ScaleHMM::~ScaleHMM()
 }
 
 // Methods ----------------------------------------------------
+void ScaleHMM::allocate_forward_backward(MatrixLayout layout, MemoryMode memory)
+{
+	// One contiguous block for scalealpha. TIME_MAJOR keeps all states of one time point together (what forward() and backward() stream over), STATE_MAJOR keeps the time course of one state together.
+	// Backward variables are not stored, backward() only keeps the current time point.
+	this->layout = layout;
+	this->memory = memory;
+	if (memory == MEMORY_LOW)
+	{
+		// Keep alpha at every k-th time point of each segment with k = ceil(sqrt(T)), so that checkpoints and the recomputed blocks need O(sqrt(T)*N) memory
+		this->checkpoint_interval = (int) ceil(sqrt((double) this->T));
+		this->layout = TIME_MAJOR;
+	}
+	else
+	{
+		this->checkpoint_interval = 1;
+	}
+	int num_rows = 0;
+	this->segment_checkpoint.resize(this->num_segments);
+	for (int s=0; s<this->num_segments; s++)
+	{
+		this->segment_checkpoint[s] = num_rows;
+		num_rows += (this->segment_start[s+1] - this->segment_start[s] + this->checkpoint_interval - 1) / this->checkpoint_interval;
+	}
+	this->alphablock_start.clear();
+
+	size_t scalealpha_size;
+	if (this->layout == TIME_MAJOR)
+	{
+		this->tstride = AlignedLength(this->N);
+		this->nstride = 1;
+		scalealpha_size = (size_t)num_rows * this->tstride;
+	}
+	else
+	{
+		this->tstride = 1;
+		this->nstride = AlignedLength(this->T);
+		scalealpha_size = (size_t)this->N * this->nstride;
+	}
+	// Blocks are only reallocated if they are too small, so that set_segments() and set_observations() reuse them
+	if (scalealpha_size > this->scalealpha_capacity)
+	{
+		if (this->scalealpha != NULL) FreeAlignedDouble(this->scalealpha);
+		this->scalealpha = CallocAlignedDouble(scalealpha_size);
+		this->scalealpha_capacity = scalealpha_size;
+	}
+	this->find_runs();
+}
+
+void ScaleHMM::reserve_alpha_blocks()
+{
+	// A thread works on one segment at a time, so one recomputed block per thread is enough, independent of the number of segments
+	int num_blocks = max_threads();
+	if (this->memory == MEMORY_LOW)
+	{
+		size_t alphablock_size = (size_t)num_blocks * this->checkpoint_interval * this->tstride;
+		if (alphablock_size > this->alphablock_capacity)
+		{
+			if (this->alphablock != NULL) FreeAlignedDouble(this->alphablock);
+			this->alphablock = CallocAlignedDouble(alphablock_size);
+			this->alphablock_capacity = alphablock_size;
+			this->alphablock_start.clear();
+		}
+	}
+	if ((int)this->alphablock_start.size() < num_blocks)
+	{
+		this->alphablock_start.resize(num_blocks, -1);
+	}
+}
+
+void ScaleHMM::free_forward_backward()
+{
+	if (this->scalealpha != NULL)
+	{
+		FreeAlignedDouble(this->scalealpha);
+	}
+	if (this->alphablock != NULL)
+	{
+		FreeAlignedDouble(this->alphablock);
+	}
+	this->scalealpha = NULL;
+	this->scalealpha_capacity = 0;
+	this->alphablock = NULL;
+	this->alphablock_capacity = 0;
+}
+
 void ScaleHMM::initialize_transition_probs(double* initial_A, bool use_initial_params)
 {
 
@@ -114,6 +454,31 @@ void ScaleHMM::initialize_transition_probs(double* initial_A, bool use_initial_p
 			}
 		}
 	}
+
+	if (this->kron_N1 > 0)
+	{
+		// Each factor holds the transitions of its component, averaged over the states of the other component. The initial A is replaced by their product.
+		int N1 = this->kron_N1;
+		int N2 = this->kron_N2;
+		this->A1.assign((size_t)N1*N1, 0.0);
+		this->A2.assign((size_t)N2*N2, 0.0);
+		for (int iN=0; iN<this->N; iN++)
+		{
+			for (int jN=0; jN<this->N; jN++)
+			{
+				this->A1[(size_t)(iN/N2)*N1 + jN/N2] += this->A[iN][jN] / N2;
+				this->A2[(size_t)(iN%N2)*N2 + jN%N2] += this->A[iN][jN] / N1;
+			}
+		}
+		this->multiply_factors();
+		for (int iN=0; iN<this->N; iN++)
+		{
+			for (int jN=0; jN<this->N; jN++)
+			{
+				initial_A[jN*this->N + iN] = this->A[iN][jN];
+			}
+		}
+	}
 	
 }
 
@@ -143,22 +508,25 @@ void ScaleHMM::baumWelch()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 
-	R_CheckUserInterrupt();
+	this->check_interrupt();
 	
 	if (this->xvariate == UNIVARIATE)
 	{
 		//FILE_LOG(logDEBUG1) << "Calling calc_densities() from baumWelch()";
 		try { this->calc_densities(); } catch(...) { throw; }
-		R_CheckUserInterrupt();
+		this->check_interrupt();
 	}
 
+	// Keep the transposed copy of A in sync for backward()
+	this->update_transposed_A();
+
 	//FILE_LOG(logDEBUG1) << "Calling forward() from baumWelch()";
 	try { this->forward(); } catch(...) { throw; }
-	R_CheckUserInterrupt();
+	this->check_interrupt();
 
 	//FILE_LOG(logDEBUG1) << "Calling backward() from baumWelch()";
 	try { this->backward(); } catch(...) { throw; }
-	R_CheckUserInterrupt();
+	this->check_interrupt();
 
 	//FILE_LOG(logDEBUG1) << "Calling calc_loglikelihood() from baumWelch()";
 	this->calc_loglikelihood();
@@ -168,76 +536,151 @@ void ScaleHMM::baumWelch()
 		throw nan_detected;
 	}
 
-	//FILE_LOG(logDEBUG1) << "Calling calc_sumxi() from baumWelch()";
-	this->calc_sumxi();
-	R_CheckUserInterrupt();
+}
+
+void ScaleHMM::viterbi()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+
+	this->check_interrupt();
+
+	if (this->xvariate == UNIVARIATE)
+	{
+		try { this->calc_densities(); } catch(...) { throw; }
+		this->check_interrupt();
+	}
 
-	//FILE_LOG(logDEBUG1) << "Calling calc_sumgamma() from baumWelch()";
-	this->calc_sumgamma();
-	R_CheckUserInterrupt();
+	// Backpointers take one byte per state and time point if the state index fits
+	this->viterbi_path.resize(this->T);
+	std::vector<double> segment_logP(this->num_segments, 0.0);
+	std::vector<int> thread_error(this->num_segments, THREAD_OK);
+	#pragma omp parallel for schedule(dynamic)
+	for (int s=0; s<this->num_segments; s++)
+	{
+		try
+		{
+			if (this->N <= 256)
+			{
+				segment_logP[s] = this->viterbi_segment<unsigned char>(s);
+			}
+			else
+			{
+				segment_logP[s] = this->viterbi_segment<int>(s);
+			}
+		}
+		catch(...)
+		{
+			thread_error[s] = current_thread_error();
+		}
+	}
+	rethrow_thread_errors(thread_error);
+	this->viterbi_logP = 0.0;
+	for (int s=0; s<this->num_segments; s++)
+	{
+		this->viterbi_logP += segment_logP[s];
+	}
+	this->check_interrupt();
 
 }
 
 void ScaleHMM::EM(int* maxiter, int* maxtime, double* eps)
+{
+	this->EM(maxiter, maxtime, eps, false);
+}
+
+void ScaleHMM::resume_EM(int* maxiter, int* maxtime, double* eps)
+{
+	this->EM(maxiter, maxtime, eps, true);
+}
+
+void ScaleHMM::EM(int* maxiter, int* maxtime, double* eps, bool resume)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 
 	double logPold = -INFINITY;
 	double logPnew;
-	double** gammaold = CallocDoubleMatrix(this->N, this->T);
 
 	// Parallelization settings
 // 	omp_set_nested(1);
 	
-	// measuring the time
-	this->EMStartTime_sec = time(NULL);
-
-	// Print some initial information
-	if (this->xvariate == UNIVARIATE)
+	int iteration = 0;
+	// Without rounds the extrapolations are planned for maxiter of this call
+	int maxiter_total = this->has_iteration_limit ? this->iteration_limit : *maxiter;
+	if (resume)
 	{
-		//FILE_LOG(logINFO) << "";
-		//FILE_LOG(logINFO) << "INITIAL PARAMETERS";
-// 		this->print_uni_params();
-		this->print_uni_iteration(0);
+		// Continue after the last Baum-Welch of the previous call, whose parameter update was not done yet, the SQUAREM cycle goes on
+		// maxiter and maxtime count from the start of the first call
+		iteration = this->EMiteration;
+		logPold = this->logP;
+		if (this->runs_lumped)
+		{
+			this->expand_runs();
+		}
+		this->EMStartTime_sec = time(NULL) - this->EMTime_real;
+		this->next_parameters(iteration, maxiter_total);
 	}
-	else if (this->xvariate == MULTIVARIATE)
+	else
 	{
-		this->print_multi_iteration(0);
+		this->squarem_phase = 0;
+		this->squarem_pending = false;
+		// measuring the time
+		this->EMStartTime_sec = time(NULL);
+
+		// Print some initial information
+		if (this->xvariate == UNIVARIATE)
+		{
+			//FILE_LOG(logINFO) << "";
+			//FILE_LOG(logINFO) << "INITIAL PARAMETERS";
+// 			this->print_uni_params();
+			this->print_uni_iteration(0);
+		}
+		else if (this->xvariate == MULTIVARIATE)
+		{
+			this->print_multi_iteration(0);
+		}
 	}
 
-	R_CheckUserInterrupt();
+	this->check_interrupt();
 
 	// Do the Baum-Welch and updates
-	int iteration = 0;
 	while (((this->EMTime_real < *maxtime) or (*maxtime < 0)) and ((iteration < *maxiter) or (*maxiter < 0)))
 	{
 
 		iteration++;
 		
-		try { this->baumWelch(); } catch(...) { throw; }
-		logPnew = this->logP;
-		this->dlogP = logPnew - logPold;
-
-		if (this->xvariate == UNIVARIATE)
+		bool extrapolated = this->squarem_pending;
+		if (this->squarem_pending)
 		{
-// 			clock_t clocktime = clock(), dtime;
-			// difference in posterior
-			//FILE_LOG(logDEBUG1) << "Calculating differences in posterior in EM()";
-			double postsum = 0.0;
-			for (int t=0; t<this->T; t++)
+			// The extrapolated parameters are kept only if they are at least as good as the last Baum-Welch, otherwise the plain EM update is used
+			this->squarem_pending = false;
+			bool failed = false;
+			try { this->baumWelch(); }
+			catch(std::exception& e)
 			{
-				for (int iN=0; iN<this->N; iN++)
-				{
-					postsum += fabs(this->gamma[iN][t] - gammaold[iN][t]);
-					gammaold[iN][t] = this->gamma[iN][t];
-				}
+				if (strcmp(e.what(),"nan detected")!=0) { throw; }
+				failed = true;
 			}
-			this->sumdiff_posterior = postsum;
-// 			dtime = clock() - clocktime;
-// 			//FILE_LOG(logDEBUG) << "differences in posterior: " << dtime << " clicks";
+			if (failed || !(this->logP >= this->squarem_logP))
+			{
+				this->squarem_stepmax = std::max(1.0, this->squarem_stepmax / SQUAREM_STEP_FACTOR);
+				this->set_parameters(this->squarem_theta2);
+				extrapolated = false;
+				iteration++;
+				try { this->baumWelch(); } catch(...) { throw; }
+			}
+			else if (this->squarem_alpha == this->squarem_stepmax)
+			{
+				this->squarem_stepmax *= SQUAREM_STEP_FACTOR;
+			}
+		}
+		else
+		{
+			try { this->baumWelch(); } catch(...) { throw; }
 		}
+		logPnew = this->logP;
+		this->dlogP = logPnew - logPold;
 
-		R_CheckUserInterrupt();
+		this->check_interrupt();
 
 		// Print information about current iteration
 		if (this->xvariate == UNIVARIATE)
@@ -249,26 +692,27 @@ void ScaleHMM::EM(int* maxiter, int* maxtime, double* eps)
 			this->print_multi_iteration(iteration);
 		}
 
-		// Check convergence
-		if((fabs(this->dlogP) < *eps) && (this->dlogP < INFINITY)) //it has converged
+		// Check convergence, the change after an extrapolation says nothing about convergence
+		if((fabs(this->dlogP) < *eps) && (this->dlogP < INFINITY) && !extrapolated) //it has converged
 		{
 			//FILE_LOG(logINFO) << "Convergence reached!\n";
-			Rprintf("Convergence reached!\n");
+			if (!this->quiet) { Rprintf("Convergence reached!\n"); }
 			break;
 		}
 		else
 		{ // not converged
 			this->EMTime_real = difftime(time(NULL),this->EMStartTime_sec);
-			if (iteration == *maxiter)
+			// A failed extrapolation counts two iterations and can step over the maxiter of a round
+			if ((iteration >= *maxiter) and (*maxiter >= 0))
 			{
 				//FILE_LOG(logINFO) << "Maximum number of iterations reached!";
-				Rprintf("Maximum number of iterations reached!\n");
+				if (!this->quiet) { Rprintf("Maximum number of iterations reached!\n"); }
 				break;
 			}
 			else if ((this->EMTime_real >= *maxtime) and (*maxtime >= 0))
 			{
 				//FILE_LOG(logINFO) << "Exceeded maximum time!";
-				Rprintf("Exceeded maximum time!\n");
+				if (!this->quiet) { Rprintf("Exceeded maximum time!\n"); }
 				break;
 			}
 			logPold = logPnew;
@@ -286,79 +730,8 @@ void ScaleHMM::EM(int* maxiter, int* maxtime, double* eps)
 // 		//FILE_LOG(logERROR) << "sumweights = " << sumweights;
 // 		
 
-		// Updating initial probabilities proba and transition matrix A
-		for (int iN=0; iN<this->N; iN++)
-		{
-			this->proba[iN] = this->gamma[iN][0];
-			//FILE_LOG(logDEBUG4) << "sumgamma["<<iN<<"] = " << sumgamma[iN];
-			if (this->sumgamma[iN] == 0)
-			{
-				//FILE_LOG(logINFO) << "Not reestimating A["<<iN<<"][x] because sumgamma["<<iN<<"] = 0";
-// 				Rprintf("Not reestimating A[%d][x] because sumgamma[%d] = 0\n", iN, iN);
-			}
-			else
-			{
-				for (int jN=0; jN<this->N; jN++)
-				{
-					//FILE_LOG(logDEBUG4) << "sumxi["<<iN<<"]["<<jN<<"] = " << sumxi[iN][jN];
-					this->A[iN][jN] = this->sumxi[iN][jN] / this->sumgamma[iN];
-					if (std::isnan(this->A[iN][jN]))
-					{
-						//FILE_LOG(logERROR) << "updating transition probabilities";
-						//FILE_LOG(logERROR) << "A["<<iN<<"]["<<jN<<"] = " << A[iN][jN];
-						//FILE_LOG(logERROR) << "sumxi["<<iN<<"]["<<jN<<"] = " << sumxi[iN][jN];
-						//FILE_LOG(logERROR) << "sumgamma["<<iN<<"] = " << sumgamma[iN];
-						throw nan_detected;
-					}
-				}
-			}
-		}
-
-		if (this->xvariate == UNIVARIATE)
-		{
-// 			clock_t clocktime = clock(), dtime;
-// 
-// 			// Update all distributions independently
-// 			for (int iN=0; iN<this->N; iN++)
-// 			{
-// 				this->densityFunctions[iN]->update(this->gamma[iN]);
-// 			}
-
-			// Update distribution of independent states first, set others as multiples of 'monosomy'
-			// This loop assumes that the dependent negative binomial states come last and are consecutive
-			int xsomy = 1;
-			for (int iN=0; iN<this->N; iN++)
-			{
-				if (this->densityFunctions[iN]->get_name() == ZERO_INFLATION) {}
-				if (this->densityFunctions[iN]->get_name() == GEOMETRIC)
-				{
-					this->densityFunctions[iN]->update(this->gamma[iN]);
-				}
-				if (this->densityFunctions[iN]->get_name() == NEGATIVE_BINOMIAL)
-				{
-					if (xsomy==1)
-					{
-						//FILE_LOG(logDEBUG1) << "mean(state="<<iN<<") = " << this->densityFunctions[iN]->get_mean() << ", var(state="<<iN<<") = " << this->densityFunctions[iN]->get_variance();
-						this->densityFunctions[iN]->update_constrained(this->gamma, iN, this->N);
-						double mean1 = this->densityFunctions[iN]->get_mean();
-						double variance1 = this->densityFunctions[iN]->get_variance();
-						//FILE_LOG(logDEBUG1) << "mean(state="<<iN<<") = " << this->densityFunctions[iN]->get_mean() << ", var(state="<<iN<<") = " << this->densityFunctions[iN]->get_variance();
-						// Set others as multiples
-						for (int jN=iN+1; jN<this->N; jN++)
-						{
-							this->densityFunctions[jN]->set_mean(mean1 * (jN-iN+1));
-							this->densityFunctions[jN]->set_variance(variance1 * (jN-iN+1));
-							//FILE_LOG(logDEBUG1) << "mean(state="<<jN<<") = " << this->densityFunctions[jN]->get_mean() << ", var(state="<<jN<<") = " << this->densityFunctions[jN]->get_variance();
-						}
-						break;
-					}
-					xsomy++;
-				}
-			}
-// 			dtime = clock() - clocktime;
-// 			//FILE_LOG(logDEBUG) << "updating distributions: " << dtime << " clicks";
-			R_CheckUserInterrupt();
-		}
+		// Update the parameters for the next iteration
+		this->next_parameters(iteration, maxiter_total);
 
 	} /* main loop end */
     
@@ -368,403 +741,1577 @@ void ScaleHMM::EM(int* maxiter, int* maxtime, double* eps)
 	//FILE_LOG(logINFO) << "FINAL ESTIMATION RESULTS";
 // 	this->print_uni_params();
 
-	// free memory
-	FreeDoubleMatrix(gammaold, this->N);
-
 	// Return values
+	this->EMiteration = iteration;
 	*maxiter = iteration;
 	*eps = this->dlogP;
 	this->EMTime_real = difftime(time(NULL),this->EMStartTime_sec);
 	*maxtime = this->EMTime_real;
 }
 
-std::vector<double> ScaleHMM::calc_weights()
+void ScaleHMM::next_parameters(int iteration, int maxiter)
 {
-	std::vector<double> weights(this->N);
-	#pragma omp parallel for
-	for (int iN=0; iN<this->N; iN++)
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	std::vector<double> theta1;
+	if (this->accelerate)
 	{
-		// Do not use weights[iN] = ( this->sumgamma[iN] + this->gamma[iN][T-1] ) / this->T; here, since states are swapped and gammas not
-		double sum_over_gammas_per_state = 0;
-		for (int t=0; t<this->T; t++)
-		{
-			sum_over_gammas_per_state += this->gamma[iN][t];
-		}
-		weights[iN] = sum_over_gammas_per_state / this->T;
+		this->get_parameters(theta1);
+	}
+	this->update_parameters();
+	// Drop states without posterior mass, an extrapolation cycle starts again with the smaller parameter vector
+	if (this->prune_threshold > 0 && iteration >= PRUNE_MIN_ITERATION && this->prune_states())
+	{
+		this->squarem_phase = 0;
+	}
+	// An extrapolation needs up to two more Baum-Welch runs
+	else if (this->accelerate && ((iteration + 2 <= maxiter) or (maxiter < 0)))
+	{
+		this->extrapolate_parameters(theta1, this->logP);
 	}
-	return(weights);
 }
 
-void ScaleHMM::calc_weights(double* weights)
+void ScaleHMM::update_parameters()
 {
-	#pragma omp parallel for
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	// Updating initial probabilities proba and transition matrix A
+	for (int iN=0; iN<this->N; iN++)
+	{
+		// All segments share the initial probabilities
+		this->proba[iN] = 0.0;
+		for (int s=0; s<this->num_segments; s++)
+		{
+			this->proba[iN] += this->gamma[iN][this->segment_start[s]];
+		}
+		this->proba[iN] /= this->num_segments;
+		if (this->kron_N1 > 0)
+		{
+			// The factors of A are updated below
+			continue;
+		}
+		//FILE_LOG(logDEBUG4) << "sumgamma["<<iN<<"] = " << sumgamma[iN];
+		if (this->sumgamma[iN] == 0)
+		{
+			//FILE_LOG(logINFO) << "Not reestimating A["<<iN<<"][x] because sumgamma["<<iN<<"] = 0";
+// 				Rprintf("Not reestimating A[%d][x] because sumgamma[%d] = 0\n", iN, iN);
+		}
+		else
+		{
+			for (int jN=0; jN<this->N; jN++)
+			{
+				//FILE_LOG(logDEBUG4) << "sumxi["<<iN<<"]["<<jN<<"] = " << sumxi[iN][jN];
+				this->A[iN][jN] = this->sumxi[iN][jN] / this->sumgamma[iN];
+				if (std::isnan(this->A[iN][jN]))
+				{
+					//FILE_LOG(logERROR) << "updating transition probabilities";
+					//FILE_LOG(logERROR) << "A["<<iN<<"]["<<jN<<"] = " << A[iN][jN];
+					//FILE_LOG(logERROR) << "sumxi["<<iN<<"]["<<jN<<"] = " << sumxi[iN][jN];
+					//FILE_LOG(logERROR) << "sumgamma["<<iN<<"] = " << sumgamma[iN];
+					throw nan_detected;
+				}
+			}
+		}
+	}
+	if (this->kron_N1 > 0)
+	{
+		// The expected log-likelihood of A1 x A2 separates into one term per factor with the xi values summed over the other factor
+		update_factor(this->A1, this->sumxi1, this->kron_N1);
+		update_factor(this->A2, this->sumxi2, this->kron_N2);
+		this->multiply_factors();
+	}
+
+	if (this->xvariate == UNIVARIATE)
+	{
+// 			clock_t clocktime = clock(), dtime;
+// 
+// 			// Update all distributions independently
+// 			for (int iN=0; iN<this->N; iN++)
+// 			{
+// 				this->densityFunctions[iN]->update(this->gamma[iN]);
+// 			}
+
+		this->update_densities();
+// 			dtime = clock() - clocktime;
+// 			//FILE_LOG(logDEBUG) << "updating distributions: " << dtime << " clicks";
+		this->check_interrupt();
+	}
+}
+
+void ScaleHMM::get_parameters(std::vector<double>& theta)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	theta.clear();
+	for (int iN=0; iN<this->N; iN++)
+	{
+		theta.push_back(log(std::max(this->proba[iN], SQUAREM_FLOOR)));
+		if (this->kron_N1 > 0)
+		{
+			continue;
+		}
+		for (int jN=0; jN<this->N; jN++)
+		{
+			theta.push_back(log(std::max(this->A[iN][jN], SQUAREM_FLOOR)));
+		}
+	}
+	if (this->kron_N1 > 0)
+	{
+		// Only the factors are parameters
+		for (size_t i=0; i<this->A1.size(); i++)
+		{
+			theta.push_back(log(std::max(this->A1[i], SQUAREM_FLOOR)));
+		}
+		for (size_t i=0; i<this->A2.size(); i++)
+		{
+			theta.push_back(log(std::max(this->A2[i], SQUAREM_FLOOR)));
+		}
+	}
+	if (this->xvariate == UNIVARIATE)
+	{
+		for (int iN=0; iN<this->N; iN++)
+		{
+			Density* d = this->densityFunctions[iN];
+			if (d->get_name() == NEGATIVE_BINOMIAL || d->get_name() == ZERO_INFLATED_NEGATIVE_BINOMIAL)
+			{
+				// The tied states are multiples of 'monosomy' in mean and variance-mean, which stays so in log-space
+				double mean = d->get_mean();
+				theta.push_back(log(mean));
+				theta.push_back(log(d->get_variance() - mean));
+			}
+			if (d->get_name() == ZERO_INFLATED_NEGATIVE_BINOMIAL)
+			{
+				double w = std::min(std::max(static_cast<ZiNB*>(d)->get_w(), SQUAREM_FLOOR), 1-1e-12);
+				theta.push_back(log(w / (1-w)));
+			}
+			if (d->get_name() == GEOMETRIC)
+			{
+				double prob = static_cast<Geometric*>(d)->get_prob();
+				theta.push_back(log(prob / (1-prob)));
+			}
+		}
+	}
+}
+
+bool ScaleHMM::set_parameters(const std::vector<double>& theta)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	int k = 0;
+	double sum_proba = 0;
+	for (int iN=0; iN<this->N; iN++)
+	{
+		this->proba[iN] = exp(std::max(theta[k++], log(SQUAREM_FLOOR)));
+		sum_proba += this->proba[iN];
+		if (this->kron_N1 > 0)
+		{
+			continue;
+		}
+		double sum_A = 0;
+		for (int jN=0; jN<this->N; jN++)
+		{
+			this->A[iN][jN] = exp(std::max(theta[k++], log(SQUAREM_FLOOR)));
+			sum_A += this->A[iN][jN];
+		}
+		for (int jN=0; jN<this->N; jN++)
+		{
+			this->A[iN][jN] /= sum_A;
+			if (!std::isfinite(this->A[iN][jN])) { return(false); }
+		}
+	}
+	for (int iN=0; iN<this->N; iN++)
+	{
+		this->proba[iN] /= sum_proba;
+		if (!std::isfinite(this->proba[iN])) { return(false); }
+	}
+	if (this->kron_N1 > 0)
+	{
+		for (int f=0; f<2; f++)
+		{
+			std::vector<double>& X = (f == 0) ? this->A1 : this->A2;
+			int n = (f == 0) ? this->kron_N1 : this->kron_N2;
+			for (int i=0; i<n; i++)
+			{
+				double sum_X = 0;
+				for (int j=0; j<n; j++)
+				{
+					X[(size_t)i*n + j] = exp(std::max(theta[k++], log(SQUAREM_FLOOR)));
+					sum_X += X[(size_t)i*n + j];
+				}
+				for (int j=0; j<n; j++)
+				{
+					X[(size_t)i*n + j] /= sum_X;
+					if (!std::isfinite(X[(size_t)i*n + j])) { return(false); }
+				}
+			}
+		}
+		this->multiply_factors();
+	}
+	if (this->xvariate == UNIVARIATE)
+	{
+		for (int iN=0; iN<this->N; iN++)
+		{
+			Density* d = this->densityFunctions[iN];
+			if (d->get_name() == NEGATIVE_BINOMIAL || d->get_name() == ZERO_INFLATED_NEGATIVE_BINOMIAL)
+			{
+				double mean = exp(theta[k++]);
+				double variance = mean + exp(theta[k++]);
+				if (!std::isfinite(variance) || mean <= 0) { return(false); }
+				d->set_mean(mean);
+				d->set_variance(variance);
+			}
+			if (d->get_name() == ZERO_INFLATED_NEGATIVE_BINOMIAL)
+			{
+				static_cast<ZiNB*>(d)->set_w(1 / (1 + exp(-theta[k++])));
+			}
+			if (d->get_name() == GEOMETRIC)
+			{
+				double prob = 1 / (1 + exp(-theta[k++]));
+				if (prob <= 0 || prob >= 1) { return(false); }
+				static_cast<Geometric*>(d)->set_prob(prob);
+			}
+		}
+	}
+	return(true);
+}
+
+void ScaleHMM::extrapolate_parameters(const std::vector<double>& theta1, double logP1)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	// A cycle consists of two EM updates theta0 -> theta1 -> theta2, followed by the extrapolation theta0 + 2*alpha*r + alpha^2*v
+	if (this->squarem_phase == 0)
+	{
+		this->squarem_theta0 = theta1;
+		this->squarem_phase = 1;
+		return;
+	}
+	this->squarem_phase = 0;
+	this->get_parameters(this->squarem_theta2);
+	const std::vector<double>& theta0 = this->squarem_theta0;
+	const std::vector<double>& theta2 = this->squarem_theta2;
+	int K = theta0.size();
+	std::vector<double> r(K), v(K), theta(K);
+	double sum_r2 = 0, sum_v2 = 0;
+	for (int k=0; k<K; k++)
+	{
+		r[k] = theta1[k] - theta0[k];
+		v[k] = theta2[k] - 2*theta1[k] + theta0[k];
+		sum_r2 += r[k]*r[k];
+		sum_v2 += v[k]*v[k];
+	}
+	if (!(sum_v2 > 0) || !std::isfinite(sum_r2))
+	{
+		return;
+	}
+	// Step length of scheme S3, alpha=1 gives theta2
+	double alpha = std::min(std::max(sqrt(sum_r2 / sum_v2), 1.0), this->squarem_stepmax);
+	if (alpha == this->squarem_stepmax && alpha <= 1)
+	{
+		this->squarem_stepmax *= SQUAREM_STEP_FACTOR;
+	}
+	for (int b=0; b<SQUAREM_BACKTRACK && alpha > 1; b++)
+	{
+		for (int k=0; k<K; k++)
+		{
+			theta[k] = theta0[k] + 2*alpha*r[k] + alpha*alpha*v[k];
+		}
+		if (this->set_parameters(theta))
+		{
+			this->squarem_alpha = alpha;
+			this->squarem_logP = logP1;
+			this->squarem_pending = true;
+			return;
+		}
+		alpha = (alpha + 1) / 2;
+	}
+	this->set_parameters(theta2);
+}
+
+void ScaleHMM::update_densities()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	switch (this->get_emission_layout())
+	{
+		case EMISSION_NB: this->update_densities_tied<false,false>(); break;
+		case EMISSION_ZI_NB: this->update_densities_tied<true,false>(); break;
+		case EMISSION_GEOM_NB: this->update_densities_tied<false,true>(); break;
+		case EMISSION_ZI_GEOM_NB: this->update_densities_tied<true,true>(); break;
+		default: this->update_densities_generic(); break;
+	}
+}
+
+void ScaleHMM::update_densities_generic()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	// Update distribution of independent states first, set others as multiples of 'monosomy'
+	// This loop assumes that the dependent negative binomial states come last and are consecutive
+	int xsomy = 1;
+	for (int iN=0; iN<this->N; iN++)
+	{
+		if (this->densityFunctions[iN]->get_name() == ZERO_INFLATION) {}
+		if (this->densityFunctions[iN]->get_name() == GEOMETRIC)
+		{
+			this->densityFunctions[iN]->update(this->gamma[iN]);
+		}
+		if (this->densityFunctions[iN]->get_name() == NEGATIVE_BINOMIAL || this->densityFunctions[iN]->get_name() == ZERO_INFLATED_NEGATIVE_BINOMIAL)
+		{
+			if (xsomy==1)
+			{
+				//FILE_LOG(logDEBUG1) << "mean(state="<<iN<<") = " << this->densityFunctions[iN]->get_mean() << ", var(state="<<iN<<") = " << this->densityFunctions[iN]->get_variance();
+				this->densityFunctions[iN]->update_constrained(this->gamma, iN, this->N);
+				double mean1 = this->densityFunctions[iN]->get_mean();
+				double variance1 = this->densityFunctions[iN]->get_variance();
+				//FILE_LOG(logDEBUG1) << "mean(state="<<iN<<") = " << this->densityFunctions[iN]->get_mean() << ", var(state="<<iN<<") = " << this->densityFunctions[iN]->get_variance();
+				// Set others as multiples
+				for (int jN=iN+1; jN<this->N; jN++)
+				{
+					this->densityFunctions[jN]->set_mean(mean1 * (jN-iN+1));
+					this->densityFunctions[jN]->set_variance(variance1 * (jN-iN+1));
+					//FILE_LOG(logDEBUG1) << "mean(state="<<jN<<") = " << this->densityFunctions[jN]->get_mean() << ", var(state="<<jN<<") = " << this->densityFunctions[jN]->get_variance();
+					// The probability of an excess zero is shared by all zero-inflated states
+					if (this->densityFunctions[iN]->get_name() == ZERO_INFLATED_NEGATIVE_BINOMIAL && this->densityFunctions[jN]->get_name() == ZERO_INFLATED_NEGATIVE_BINOMIAL)
+					{
+						static_cast<ZiNB*>(this->densityFunctions[jN])->set_w(static_cast<ZiNB*>(this->densityFunctions[iN])->get_w());
+					}
+				}
+				break;
+			}
+			xsomy++;
+		}
+	}
+}
+
+template<bool HasZeroInflation, bool HasGeometric>
+void ScaleHMM::update_densities_tied()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	// Same updates as update_densities_generic(), but the posteriors of all geometric and negative binomial states are summed per read count in a single pass
+	const int first = (int)HasZeroInflation;
+	const int first_nb = (int)HasZeroInflation + (int)HasGeometric;
+	const int ld = this->max_obs+1;
+	std::vector<double> gamma_per_read((size_t)(this->N - first) * ld, 0.0);
+	for (int t=0; t<this->T; t++)
+	{
+		double* gamma_per_read_t = &gamma_per_read[this->obs[t]];
+		for (int iN=first; iN<this->N; iN++)
+		{
+			gamma_per_read_t[(size_t)(iN - first) * ld] += this->gamma[iN][t];
+		}
+	}
+	if (HasGeometric)
+	{
+		static_cast<Geometric*>(this->densityFunctions[first])->update_per_read(&gamma_per_read[0]);
+	}
+	// Update 'monosomy' and set the others as multiples
+	NegativeBinomial* d = static_cast<NegativeBinomial*>(this->densityFunctions[first_nb]);
+	d->update_constrained_per_read(&gamma_per_read[(size_t)(first_nb - first) * ld], this->N - first_nb);
+	double mean1 = d->get_mean();
+	double variance1 = d->get_variance();
+	for (int jN=first_nb+1; jN<this->N; jN++)
+	{
+		this->densityFunctions[jN]->set_mean(mean1 * (jN-first_nb+1));
+		this->densityFunctions[jN]->set_variance(variance1 * (jN-first_nb+1));
+	}
+}
+
+std::vector<double> ScaleHMM::calc_weights()
+{
+	std::vector<double> weights(this->N_full);
+	this->calc_weights(&weights[0]);
+	return(weights);
+}
+
+void ScaleHMM::calc_weights(double* weights)
+{
+	// States are indexed as before pruning, pruned states have no posterior mass
+	#pragma omp parallel for
+	for (int i=0; i<this->N_full; i++)
+	{
+		// Do not use weights[iN] = ( this->sumgamma[iN] + this->gamma[iN][T-1] ) / this->T; here, since states are swapped and gammas not
+		int iN = this->state_position[i];
+		double sum_over_gammas_per_state = 0;
+		if (iN >= 0)
+		{
+			for (int t=0; t<this->T; t++)
+			{
+				sum_over_gammas_per_state += this->gamma[iN][t];
+			}
+		}
+		weights[i] = sum_over_gammas_per_state / this->T;
+	}
+}
+
+// Getters and Setters ----------------------------------------
+void ScaleHMM::get_posteriors(double** post)
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	if (this->runs_lumped)
+	{
+		this->expand_runs();
+	}
+	// States are indexed as before pruning, pruned states have no posterior mass
+	for (int i=0; i<this->N_full; i++)
+	{
+		int iN = this->state_position[i];
+		for (int t=0; t<this->T; t++)
+		{
+			post[i][t] = (iN < 0) ? 0.0 : this->gamma[iN][t];
+		}
+	}
+}
+
+double ScaleHMM::get_posterior(int iN, int t)
+{
+	//FILE_LOG(logDEBUG4) << __PRETTY_FUNCTION__;
+	if (this->runs_lumped)
+	{
+		this->expand_runs();
+	}
+	// States are indexed as before pruning, pruned states have no posterior mass
+	iN = this->state_position[iN];
+	if (iN < 0)
+	{
+		return(0.0);
+	}
+	return(this->gamma[iN][t]);
+}
+
+int ScaleHMM::get_viterbi_state(int t)
+{
+	return(this->active_state[this->viterbi_path[t]]);
+}
+
+double ScaleHMM::get_viterbi_logP()
+{
+	return(this->viterbi_logP);
+}
+
+double ScaleHMM::get_proba(int i)
+{
+	i = this->state_position[i];
+	return( (i < 0) ? 0.0 : this->proba[i] );
+}
+
+double ScaleHMM::get_A(int i, int j)
+{
+	// Pruned states are never entered and stay in themselves
+	int i_active = this->state_position[i];
+	int j_active = this->state_position[j];
+	if (i_active < 0)
+	{
+		return( (i == j) ? 1.0 : 0.0 );
+	}
+	if (j_active < 0)
+	{
+		return(0.0);
+	}
+	return( this->A[i_active][j_active] );
+}
+
+double ScaleHMM::get_logP()
+{
+	return( this->logP );
+}
+
+double ScaleHMM::get_posterior_diff()
+{
+	return( this->sumdiff_posterior );
+}
+
+void ScaleHMM::set_cutoff(int cutoff)
+{
+	this->cutoff = cutoff;
+}
+
+void ScaleHMM::set_posterior_diff(bool posterior_diff)
+{
+	this->posterior_diff = posterior_diff;
+}
+
+void ScaleHMM::set_quiet(bool quiet)
+{
+	this->quiet = quiet;
+}
+
+void ScaleHMM::set_acceleration(bool accelerate)
+{
+	this->accelerate = accelerate;
+}
+
+void ScaleHMM::set_iteration_limit(int maxiter)
+{
+	this->iteration_limit = maxiter;
+	this->has_iteration_limit = true;
+}
+
+void ScaleHMM::set_pruning(double threshold)
+{
+	this->prune_threshold = (this->xvariate == MULTIVARIATE && this->kron_N1 == 0) ? threshold : 0;
+}
+
+void ScaleHMM::restore_states()
+{
+	if (this->N == this->N_full)
+	{
+		return;
+	}
+	std::vector<int> states(this->N_full);
+	for (int iN=0; iN<this->N_full; iN++)
+	{
+		states[iN] = iN;
+	}
+	this->set_active_states(states);
+}
+
+bool ScaleHMM::is_pruned(int i)
+{
+	return(this->pruned[i] == 1);
+}
+
+void ScaleHMM::set_kronecker(int N1)
+{
+	// forward() and backward() apply A1 and A2 one after the other, O(N*(N1+N2)) instead of O(N^2) per time point. A is kept as their product for viterbi() and get_A()
+	this->kron_N1 = N1;
+	this->kron_N2 = this->N / N1;
+	this->sumxi1.assign((size_t)this->kron_N1 * this->kron_N1, 0.0);
+	this->sumxi2.assign((size_t)this->kron_N2 * this->kron_N2, 0.0);
+}
+
+void ScaleHMM::set_interruptible(bool interruptible)
+{
+	this->interruptible = interruptible;
+}
+
+void ScaleHMM::set_segments(int num_segments, int* segment_starts)
+{
+	// Segments (e.g. chromosomes) are modelled as independent chains with shared parameters
+	this->num_segments = num_segments;
+	this->segment_start.resize(num_segments + 1);
+	for (int s=0; s<num_segments; s++)
+	{
+		this->segment_start[s] = segment_starts[s];
+	}
+	this->segment_start[num_segments] = this->T;
+	// Checkpoints and recomputed blocks depend on the segments
+	this->allocate_forward_backward(this->layout, this->memory);
+}
+
+void ScaleHMM::set_observations(int* observations, int T, int num_segments, int* segment_starts)
+{
+	// Univariate only. Parameters are kept and the density functions are rebound to the new observations, the buffers for the time points and the density table only grow.
+	this->obs = observations;
+	this->T = T;
+	for (int iN=0; iN<this->N; iN++)
+	{
+		this->densityFunctions[iN]->set_observations(observations, T);
+	}
+	if (T > this->T_capacity)
+	{
+		Free(this->scalefactoralpha);
+		FreeAlignedDoubleMatrix(this->gamma);
+		this->scalefactoralpha = (double*) Calloc(T, double);
+		this->gamma = CallocAlignedDoubleMatrix(this->N, T);
+		this->T_capacity = T;
+	}
+	int max_obs = intMax(observations, T);
+	if (max_obs > this->max_obs)
+	{
+		FreeAlignedDoubleMatrix(this->densities);
+		this->densities = CallocAlignedDoubleMatrix(max_obs+1, this->N);
+		this->max_obs = max_obs;
+	}
+	this->logP = -INFINITY;
+	this->viterbi_logP = -INFINITY;
+	this->set_segments(num_segments, segment_starts);
+}
+
+// Private ====================================================
+// Methods ----------------------------------------------------
+void ScaleHMM::forward()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+//	clock_t time = clock(), dtime;
+
+	if (!this->run_start.empty())
+	{
+		this->calc_run_powers();
+	}
+
+	// Segments are independent chains, errors thrown inside a #pragma must be handled inside the thread
+	std::vector<int> thread_error(this->num_segments, THREAD_OK);
+	#pragma omp parallel for schedule(dynamic)
+	for (int s=0; s<this->num_segments; s++)
+	{
+		try
+		{
+			this->forward_segment(s);
+		}
+		catch(...)
+		{
+			thread_error[s] = current_thread_error();
+		}
+	}
+	rethrow_thread_errors(thread_error);
+
+//	dtime = clock() - time;
+//	//FILE_LOG(logDEBUG) << "forward(): " << dtime << " clicks";
+}
+
+void ScaleHMM::forward_segment(int s)
+{
+	int tstart = this->segment_start[s];
+	int tend = this->segment_start[s+1];
+	int ld = AlignedLength(this->N);
+	std::vector<double> alpha(ld); // scaled alpha of the previous time point, contiguous for the kernel
+	std::vector<double> helpsum(ld);
+	std::vector<double> scratch(this->scratch_size());
+	DensityBlock dens_block(this->N);
+	int r = this->segment_run[s]; // next run
+	// Initialization
+	this->scalefactoralpha[tstart] = 0.0;
+	const double* dens_t = this->densities_at(tstart, dens_block);
+	for (int iN=0; iN<this->N; iN++)
+	{
+		alpha[iN] = this->proba[iN] * dens_t[iN];
+		//FILE_LOG(logDEBUG4) << "alpha["<<iN<<"] = " << alpha[iN];
+		this->scalefactoralpha[tstart] += alpha[iN];
+	}
+	//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<tstart<<"] = " << scalefactoralpha[tstart];
+	for (int iN=0; iN<this->N; iN++)
+	{
+		alpha[iN] = alpha[iN] / this->scalefactoralpha[tstart];
+		this->alpha(this->segment_checkpoint[s], iN) = alpha[iN]; // the start of a segment is always a checkpoint
+		//FILE_LOG(logDEBUG4) << "scalealpha["<<tstart<<"]["<<iN<<"] = " << scalealpha[tstart][iN];
+	}
+	// Induction
+	for (int t=tstart+1; t<tend; t++)
+	{
+		// helpsum[iN] = sum_jN alpha[jN] * A[jN][iN]
+		this->transition_forward(&alpha[0], &helpsum[0], &scratch[0]);
+		this->scalefactoralpha[t] = 0.0;
+		dens_t = this->densities_at(t, dens_block);
+		for (int iN=0; iN<this->N; iN++)
+		{
+			alpha[iN] = helpsum[iN] * dens_t[iN];
+			//FILE_LOG(logDEBUG4) << "alpha["<<iN<<"] = " << alpha[iN];
+			this->scalefactoralpha[t] += alpha[iN];
+		}
+		//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<t<<"] = " << scalefactoralpha[t];
+		bool checkpoint = ((t - tstart) % this->checkpoint_interval == 0);
+		for (int iN=0; iN<this->N; iN++)
+		{
+			alpha[iN] = alpha[iN] / this->scalefactoralpha[t];
+			if (checkpoint)
+			{
+				this->alpha(this->segment_checkpoint[s] + (t - tstart) / this->checkpoint_interval, iN) = alpha[iN];
+			}
+			//FILE_LOG(logDEBUG4) << "scalealpha["<<t<<"]["<<iN<<"] = " << scalealpha[t][iN];
+			if(std::isnan(alpha[iN]))
+			{
+				//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
+				//FILE_LOG(logERROR) << "scalefactoralpha["<<t<<"] = "<<scalefactoralpha[t] << ", densities = "<<dens_t[iN];
+				//FILE_LOG(logERROR) << "scalealpha["<<t<<"]["<<iN<<"] = " << alpha[iN];
+				throw nan_detected;
+			}
+		}
+		// Step over a run of identical observations, its inner scaling factors are set to their geometric mean
+		if (r < this->segment_run[s+1] && t == this->run_start[r])
+		{
+			int t1 = this->run_end[r];
+			double scalefactor = exp(this->jump_alpha(r, &alpha[0]) / (t1 - t));
+			for (int u=t+1; u<=t1; u++)
+			{
+				this->scalefactoralpha[u] = scalefactor;
+			}
+			t = t1;
+			if ((t - tstart) % this->checkpoint_interval == 0)
+			{
+				for (int iN=0; iN<this->N; iN++)
+				{
+					this->alpha(this->segment_checkpoint[s] + (t - tstart) / this->checkpoint_interval, iN) = alpha[iN];
+				}
+			}
+			for (int iN=0; iN<this->N; iN++)
+			{
+				if (std::isnan(alpha[iN]))
+				{
+					throw nan_detected;
+				}
+			}
+			r++;
+		}
+	}
+}
+
+void ScaleHMM::backward()
+{
+	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+//	clock_t time = clock(), dtime;
+
+	// Each segment accumulates its own sumxi and sumgamma. They are reduced in segment order, so the result does not depend on the number of threads.
+	// With a Kronecker-structured A only the xi values of the two factors are summed, one after the other
+	int ld = AlignedLength(this->N);
+	size_t sumxi_size = (this->kron_N1 > 0) ? (size_t)this->kron_N1*this->kron_N1 + (size_t)this->kron_N2*this->kron_N2 : (size_t)this->N * ld;
+	std::vector<double> segment_sumxi((size_t)this->num_segments * sumxi_size, 0.0);
+	std::vector<double> segment_sumgamma((size_t)this->num_segments * this->N, 0.0);
+	std::vector<double> segment_sumdiff(this->num_segments, 0.0);
+	this->reserve_alpha_blocks();
+	std::vector<int> thread_error(this->num_segments, THREAD_OK);
+	#pragma omp parallel for schedule(dynamic)
+	for (int s=0; s<this->num_segments; s++)
+	{
+		try
+		{
+			this->backward_segment(s, &segment_sumxi[(size_t)s * sumxi_size], &segment_sumgamma[(size_t)s * this->N], &segment_sumdiff[s]);
+		}
+		catch(...)
+		{
+			thread_error[s] = current_thread_error();
+		}
+	}
+	rethrow_thread_errors(thread_error);
+
+	// Reduce and multiply with the transition probabilities
+	if (this->kron_N1 > 0)
+	{
+		size_t size1 = this->sumxi1.size();
+		size_t size2 = this->sumxi2.size();
+		for (size_t i=0; i<size1; i++)
+		{
+			this->sumxi1[i] = 0.0;
+			for (int s=0; s<this->num_segments; s++)
+			{
+				this->sumxi1[i] += segment_sumxi[(size_t)s * sumxi_size + i];
+			}
+			this->sumxi1[i] *= this->A1[i];
+		}
+		for (size_t i=0; i<size2; i++)
+		{
+			this->sumxi2[i] = 0.0;
+			for (int s=0; s<this->num_segments; s++)
+			{
+				this->sumxi2[i] += segment_sumxi[(size_t)s * sumxi_size + size1 + i];
+			}
+			this->sumxi2[i] *= this->A2[i];
+		}
+	}
+	for (int iN=0; iN<this->N; iN++)
+	{
+		this->sumgamma[iN] = 0.0;
+		for (int s=0; s<this->num_segments; s++)
+		{
+			this->sumgamma[iN] += segment_sumgamma[(size_t)s * this->N + iN];
+		}
+		if (this->kron_N1 > 0)
+		{
+			continue;
+		}
+		for (int jN=0; jN<this->N; jN++)
+		{
+			this->sumxi[iN][jN] = 0.0;
+		}
+		for (int s=0; s<this->num_segments; s++)
+		{
+			const double* sumxi_i = &segment_sumxi[(size_t)s * sumxi_size + (size_t)iN * ld];
+			for (int jN=0; jN<this->N; jN++)
+			{
+				this->sumxi[iN][jN] += sumxi_i[jN];
+			}
+		}
+		for (int jN=0; jN<this->N; jN++)
+		{
+			this->sumxi[iN][jN] *= this->A[iN][jN];
+		}
+	}
+
+	if (this->posterior_diff)
+	{
+		this->sumdiff_posterior = 0.0;
+		for (int s=0; s<this->num_segments; s++)
+		{
+			this->sumdiff_posterior += segment_sumdiff[s];
+		}
+	}
+	this->runs_lumped = !this->run_start.empty();
+
+//	dtime = clock() - time;
+//	//FILE_LOG(logDEBUG) << "backward(): " << dtime << " clicks";
+}
+
+void ScaleHMM::backward_segment(int s, double* sumxi_s, double* sumgamma_s, double* sumdiff_s)
+{
+	// One reverse sweep computes beta, gamma, sumgamma and sumxi. Only beta of the current and the next time point is kept.
+	// gamma still holds the posteriors of the last sweep, so their difference to the new ones is summed into sumdiff_s on the way if posterior_diff is set.
+	// xi[iN][jN] at t is alpha[t][iN] * A[iN][jN] * densbeta[jN], so the outer products alpha x densbeta are summed over t into sumxi_s [N x ld] and multiplied with A in backward().
+	int tstart = this->segment_start[s];
+	int tend = this->segment_start[s+1];
+	int ld = AlignedLength(this->N);
+	std::vector<double> beta(ld);
+	std::vector<double> densbeta(ld); // density of state jN at t+1 times beta[t+1][jN], contiguous for the kernel
+	std::vector<double> alpha_t(ld);
+	std::vector<double> sumgamma_run(ld);
+	std::vector<double> scratch(this->scratch_size());
+	DensityBlock dens_block(this->N);
+	int r = this->segment_run[s+1] - 1; // next run from the end
+	const bool posterior_diff = this->posterior_diff;
+	double sumdiff = 0.0;
+	this->alphablock_start[thread_num()] = -1; // A and densities have changed since the last sweep
+
+	// Initialization
+	//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<tend-1<<"] = " << scalefactoralpha[tend-1];
+	this->get_alpha(s, tend-1, &alpha_t[0]);
+	for (int iN=0; iN<this->N; iN++)
+	{
+		beta[iN] = 1.0 / this->scalefactoralpha[tend-1];
+		// gamma goes until the end of the segment, sumgamma only until the second last time point
+		double gamma_t = alpha_t[iN] * beta[iN] * this->scalefactoralpha[tend-1];
+		if (posterior_diff) { sumdiff += fabs(gamma_t - this->gamma[iN][tend-1]); }
+		this->gamma[iN][tend-1] = gamma_t;
+	}
+	// Induction
+	for (int t=tend-2; t>=tstart; t--)
+	{
+		// Step over a run of identical observations, its posteriors are summed up at its start
+		if (r >= this->segment_run[s] && t+1 == this->run_end[r])
+		{
+			int t0 = this->run_start[r];
+			for (int iN=0; iN<this->N; iN++)
+			{
+				this->run_beta[(size_t)r * ld + iN] = beta[iN];
+			}
+			this->get_alpha(s, t0, &alpha_t[0]);
+			this->jump_beta(r, &alpha_t[0], &beta[0], sumxi_s, &sumgamma_run[0]);
+			for (int iN=0; iN<this->N; iN++)
+			{
+				if (posterior_diff) { sumdiff += fabs(sumgamma_run[iN] - this->gamma[iN][t0]); }
+				this->gamma[iN][t0] = sumgamma_run[iN];
+				sumgamma_s[iN] += sumgamma_run[iN];
+				for (int u=t0+1; u<t+1; u++)
+				{
+					if (posterior_diff) { sumdiff += this->gamma[iN][u]; }
+					this->gamma[iN][u] = 0.0;
+				}
+			}
+			t = t0;
+			r--;
+			continue;
+		}
+		const double* dens_t = this->densities_at(t+1, dens_block);
+		for (int jN=0; jN<this->N; jN++)
+		{
+			densbeta[jN] = dens_t[jN] * beta[jN];
+		}
+		// sumxi[iN][jN] += alpha[t][iN] * densbeta[jN], padding of densbeta stays zero
+		this->get_alpha(s, t, &alpha_t[0]);
+		if (this->kron_N1 > 0)
+		{
+			this->accumulate_kronecker_xi(&alpha_t[0], &densbeta[0], sumxi_s, sumxi_s + (size_t)this->kron_N1*this->kron_N1, &scratch[0]);
+		}
+		else
+		{
+			for (int iN=0; iN<this->N; iN++)
+			{
+				const double alpha_ti = alpha_t[iN];
+				double* sumxi_i = sumxi_s + (size_t)iN * ld;
+				for (int jN=0; jN<ld; jN++)
+				{
+					sumxi_i[jN] += alpha_ti * densbeta[jN];
+				}
+			}
+		}
+		// beta[iN] = sum_jN A[iN][jN] * densbeta[jN] = sum_jN At[jN][iN] * densbeta[jN]
+		this->transition_backward(&densbeta[0], &beta[0], &scratch[0]);
+		//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<t<<"] = " << scalefactoralpha[t];
+		for (int iN=0; iN<this->N; iN++)
+		{
+			beta[iN] = beta[iN] / this->scalefactoralpha[t];
+			//FILE_LOG(logDEBUG4) << "scalebeta["<<t<<"]["<<iN<<"] = " << beta[iN];
+			if (std::isnan(beta[iN]))
+			{
+				//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
+				//FILE_LOG(logERROR) << "this->scalefactoralpha[t]["<<t<<"] = "<<this->scalefactoralpha[t] << ", densities = "<<dens_t[iN];
+				//FILE_LOG(logERROR) << "scalebeta["<<iN<<"]["<<t<<"] = " << beta[iN];
+				throw nan_detected;
+			}
+			double gamma_t = alpha_t[iN] * beta[iN] * this->scalefactoralpha[t];
+			if (posterior_diff) { sumdiff += fabs(gamma_t - this->gamma[iN][t]); }
+			this->gamma[iN][t] = gamma_t;
+			sumgamma_s[iN] += gamma_t;
+		}
+	}
+	*sumdiff_s = sumdiff;
+}
+
+template<typename Backpointer>
+double ScaleHMM::viterbi_segment(int s)
+{
+	// delta[jN] is the probability of the best path that ends in state jN, scaled to a maximum of 1 at every time point
+	int tstart = this->segment_start[s];
+	int tend = this->segment_start[s+1];
+	int ld = AlignedLength(this->N);
+	std::vector<Backpointer> backpointer((size_t)(tend - tstart) * this->N);
+	std::vector<double> delta(ld); // padding stays zero for the kernel
+	std::vector<double> helpdelta(ld);
+	std::vector<int> argmax(ld);
+	DensityBlock dens_block(this->N);
+	double logscale = 0.0;
+	// Initialization
+	const double* dens_t = this->densities_at(tstart, dens_block);
+	double maximum = 0.0;
+	for (int iN=0; iN<this->N; iN++)
+	{
+		delta[iN] = this->proba[iN] * dens_t[iN];
+		maximum = std::max(maximum, delta[iN]);
+	}
+	if (!(maximum > 0)) { throw nan_detected; }
+	for (int iN=0; iN<this->N; iN++)
+	{
+		delta[iN] /= maximum;
+	}
+	logscale += log(maximum);
+	// Induction
+	for (int t=tstart+1; t<tend; t++)
+	{
+		Backpointer* bp = &backpointer[(size_t)(t - tstart) * this->N];
+		// helpdelta[jN] = max_iN delta[iN] * A[iN][jN], the backpointer is the first state iN that reaches it
+		this->maxvec(&delta[0], this->A[0], ld, this->N, &helpdelta[0], &argmax[0]);
+		for (int jN=0; jN<this->N; jN++)
+		{
+			bp[jN] = argmax[jN];
+		}
+		dens_t = this->densities_at(t, dens_block);
+		maximum = 0.0;
+		for (int jN=0; jN<this->N; jN++)
+		{
+			delta[jN] = helpdelta[jN] * dens_t[jN];
+			maximum = std::max(maximum, delta[jN]);
+		}
+		if (!(maximum > 0)) { throw nan_detected; }
+		for (int jN=0; jN<this->N; jN++)
+		{
+			delta[jN] /= maximum;
+		}
+		logscale += log(maximum);
+	}
+	// Traceback
+	this->viterbi_path[tend-1] = std::max_element(delta.begin(), delta.begin() + this->N) - delta.begin();
+	for (int t=tend-1; t>tstart; t--)
+	{
+		this->viterbi_path[t-1] = backpointer[(size_t)(t - tstart) * this->N + this->viterbi_path[t]];
+	}
+	return(logscale);
+}
+
+void ScaleHMM::recompute_alpha_block(int s, int tstart, int tend)
+{
+	// Same operations as in forward_segment(), so the recomputed values are identical to the ones of the forward sweep
+	int ld = this->tstride;
+	int block = thread_num();
+	double* row = this->alphablock + (size_t)block * this->checkpoint_interval * ld;
+	const double* checkpoint = this->scalealpha + (size_t)(this->segment_checkpoint[s] + (tstart - this->segment_start[s]) / this->checkpoint_interval) * ld;
+	for (int iN=0; iN<ld; iN++)
+	{
+		row[iN] = checkpoint[iN];
+	}
+	// Runs do not cross checkpoints, the first one in this block may start at the checkpoint
+	int r = std::lower_bound(this->run_start.begin() + this->segment_run[s], this->run_start.begin() + this->segment_run[s+1], tstart) - this->run_start.begin();
+	std::vector<double> scratch(this->scratch_size());
+	DensityBlock dens_block(this->N);
+	for (int t=tstart; t<tend; t++)
+	{
+		if (t > tstart)
+		{
+			double* prevrow = row;
+			row += ld;
+			this->transition_forward(prevrow, row, &scratch[0]);
+			const double* dens_t = this->densities_at(t, dens_block);
+			for (int iN=0; iN<this->N; iN++)
+			{
+				row[iN] = (row[iN] * dens_t[iN]) / this->scalefactoralpha[t];
+			}
+		}
+		if (r < this->segment_run[s+1] && t == this->run_start[r])
+		{
+			double* prevrow = row;
+			row += (size_t)(this->run_end[r] - t) * ld;
+			for (int iN=0; iN<ld; iN++)
+			{
+				row[iN] = prevrow[iN];
+			}
+			this->jump_alpha(r, row);
+			t = this->run_end[r];
+			r++;
+		}
+	}
+	this->alphablock_start[block] = tstart;
+}
+
+void ScaleHMM::get_alpha(int s, int t, double* alpha_t)
+{
+	if (this->memory == MEMORY_LOW)
+	{
+		int offset = (t - this->segment_start[s]) % this->checkpoint_interval;
+		int tstart = t - offset;
+		// Time points are unique across segments, so the first time point identifies the block
+		int block = thread_num();
+		if (tstart != this->alphablock_start[block])
+		{
+			this->recompute_alpha_block(s, tstart, std::min(tstart + this->checkpoint_interval, this->segment_start[s+1]));
+		}
+		const double* row = this->alphablock + ((size_t)block * this->checkpoint_interval + offset) * this->tstride;
+		for (int iN=0; iN<this->N; iN++)
+		{
+			alpha_t[iN] = row[iN];
+		}
+	}
+	else
+	{
+		for (int iN=0; iN<this->N; iN++)
+		{
+			alpha_t[iN] = this->alpha(t, iN);
+		}
+	}
+}
+
+void ScaleHMM::update_transposed_A()
+{
+	for (int iN=0; iN<this->N; iN++)
+	{
+		for (int jN=0; jN<this->N; jN++)
+		{
+			this->At[jN][iN] = this->A[iN][jN];
+		}
+	}
+	if (this->kron_N1 > 0)
+	{
+		pad_rows(this->A1, this->kron_N1, false, this->A1k);
+		pad_rows(this->A1, this->kron_N1, true, this->A1tk);
+		pad_rows(this->A2, this->kron_N2, false, this->A2k);
+		pad_rows(this->A2, this->kron_N2, true, this->A2tk);
+	}
+}
+
+void ScaleHMM::transition_forward(const double* alpha, double* helpsum, double* scratch)
+{
+	if (this->kron_N1 > 0)
+	{
+		kron_vecmat(this->matvec, alpha, &this->A1tk[0], &this->A2k[0], this->kron_N1, this->kron_N2, scratch, helpsum);
+	}
+	else
+	{
+		this->matvec(alpha, this->A[0], AlignedLength(this->N), this->N, helpsum);
+	}
+}
+
+void ScaleHMM::transition_backward(const double* densbeta, double* beta, double* scratch)
+{
+	if (this->kron_N1 > 0)
+	{
+		// (A1 x A2) * densbeta = (A1t x A2t)^T * densbeta
+		kron_vecmat(this->matvec, densbeta, &this->A1k[0], &this->A2tk[0], this->kron_N1, this->kron_N2, scratch, beta);
+	}
+	else
+	{
+		this->matvec(densbeta, this->At[0], AlignedLength(this->N), this->N, beta);
+	}
+}
+
+void ScaleHMM::accumulate_kronecker_xi(const double* alpha_t, const double* densbeta, double* sumxi1_s, double* sumxi2_s, double* scratch)
+{
+	// xi[(i1,i2)][(j1,j2)] = alpha[i1][i2] * A1[i1][j1] * A2[i2][j2] * densbeta[j1][j2]. The factors A1 and A2 of the sums are multiplied in backward().
+	// All products go through the kernel, so the operands are copied into zero-padded rows first.
+	int N1 = this->kron_N1;
+	int N2 = this->kron_N2;
+	int ld1 = AlignedLength(N1);
+	int ld2 = AlignedLength(N2);
+	double* densbeta_rows = scratch; // [N1 x ld2] densbeta[j1][j2]
+	double* densbeta_cols = densbeta_rows + (size_t)N1*ld2; // [N2 x ld1] densbeta[j1][j2] at [j2][j1]
+	double* W = densbeta_cols + (size_t)N2*ld1; // [N2 x ld1]
+	double* V = W + (size_t)N2*ld1; // [N1 x ld2]
+	double* alpha_cols = V + (size_t)N1*ld2; // [N2 x N1] alpha[i1][i2] at [i2][i1]
+	double* row = alpha_cols + (size_t)N2*N1; // one padded row of either length
+	for (int j1=0; j1<N1; j1++)
+	{
+		for (int j2=0; j2<ld2; j2++)
+		{
+			densbeta_rows[(size_t)j1*ld2 + j2] = (j2 < N2) ? densbeta[(size_t)j1*N2 + j2] : 0.0;
+		}
+	}
+	for (int j2=0; j2<N2; j2++)
+	{
+		for (int j1=0; j1<ld1; j1++)
+		{
+			densbeta_cols[(size_t)j2*ld1 + j1] = (j1 < N1) ? densbeta[(size_t)j1*N2 + j2] : 0.0;
+		}
+		for (int i1=0; i1<N1; i1++)
+		{
+			alpha_cols[(size_t)j2*N1 + i1] = alpha_t[(size_t)i1*N2 + j2];
+		}
+	}
+	// Summed over i2 and j2: sumxi1[i1][j1] += sum_i2 alpha[i1][i2] * W[i2][j1] with W[i2][j1] = sum_j2 A2[i2][j2] * densbeta[j1][j2]
+	for (int i2=0; i2<N2; i2++)
+	{
+		this->matvec(&this->A2k[(size_t)i2*ld2], densbeta_cols, ld1, N2, W + (size_t)i2*ld1);
+	}
+	for (int i1=0; i1<N1; i1++)
+	{
+		this->matvec(alpha_t + (size_t)i1*N2, W, ld1, N2, row);
+		double* sumxi1_i1 = sumxi1_s + (size_t)i1*N1;
+		for (int j1=0; j1<N1; j1++)
+		{
+			sumxi1_i1[j1] += row[j1];
+		}
+	}
+	// Summed over i1 and j1: sumxi2[i2][j2] += sum_i1 alpha[i1][i2] * V[i1][j2] with V[i1][j2] = sum_j1 A1[i1][j1] * densbeta[j1][j2]
+	for (int i1=0; i1<N1; i1++)
+	{
+		this->matvec(&this->A1k[(size_t)i1*ld1], densbeta_rows, ld2, N1, V + (size_t)i1*ld2);
+	}
+	for (int i2=0; i2<N2; i2++)
+	{
+		this->matvec(alpha_cols + (size_t)i2*N1, V, ld2, N1, row);
+		double* sumxi2_i2 = sumxi2_s + (size_t)i2*N2;
+		for (int j2=0; j2<N2; j2++)
+		{
+			sumxi2_i2[j2] += row[j2];
+		}
+	}
+}
+
+bool ScaleHMM::prune_states()
+{
+	// sumgamma is the expected number of time points in each state
+	double total = 0.0;
+	for (int iN=0; iN<this->N; iN++)
+	{
+		total += this->sumgamma[iN];
+	}
+	std::vector<int> states;
+	for (int iN=0; iN<this->N; iN++)
+	{
+		if (this->sumgamma[iN] >= this->prune_threshold * total)
+		{
+			states.push_back(this->active_state[iN]);
+		}
+	}
+	if (states.empty() || (int)states.size() == this->N)
+	{
+		return(false);
+	}
+	for (int iN=0; iN<this->N; iN++)
+	{
+		if (this->sumgamma[iN] < this->prune_threshold * total)
+		{
+			this->pruned[this->active_state[iN]] = 1;
+		}
+	}
+	if (!this->quiet) { Rprintf("Pruned %d states with a posterior mass below %g, %d states remain\n", this->N - (int)states.size(), this->prune_threshold, (int)states.size()); }
+	this->set_active_states(states);
+	return(true);
+}
+
+void ScaleHMM::set_active_states(const std::vector<int>& states)
+{
+	// Keep the parameters of the current active states for a later restore_states()
+	int Nf = this->N_full;
+	if (this->full_A.empty())
+	{
+		this->full_A.assign((size_t)Nf*Nf, 0.0);
+		this->full_proba.assign(Nf, 0.0);
+	}
+	for (int iN=0; iN<this->N; iN++)
+	{
+		this->full_proba[this->active_state[iN]] = this->proba[iN];
+		for (int jN=0; jN<this->N; jN++)
+		{
+			this->full_A[(size_t)this->active_state[iN]*Nf + this->active_state[jN]] = this->A[iN][jN];
+		}
+	}
+
+	// Compact A and proba, rows are renormalized to the new states
+	int N = states.size();
+	this->N = N;
+	FreeAlignedDoubleMatrix(this->A);
+	FreeAlignedDoubleMatrix(this->At);
+	FreeAlignedDoubleMatrix(this->sumxi);
+	this->A = CallocAlignedDoubleMatrix(N, N);
+	this->At = CallocAlignedDoubleMatrix(N, N);
+	this->sumxi = CallocAlignedDoubleMatrix(N, N);
+	double sum_proba = 0.0;
+	for (int iN=0; iN<N; iN++)
+	{
+		double sum_A = 0.0;
+		for (int jN=0; jN<N; jN++)
+		{
+			this->A[iN][jN] = this->full_A[(size_t)states[iN]*Nf + states[jN]];
+			sum_A += this->A[iN][jN];
+		}
+		for (int jN=0; jN<N; jN++)
+		{
+			this->A[iN][jN] = (sum_A > 0) ? this->A[iN][jN] / sum_A : (double)(iN == jN);
+		}
+		this->proba[iN] = this->full_proba[states[iN]];
+		sum_proba += this->proba[iN];
+	}
+	for (int iN=0; iN<N; iN++)
+	{
+		this->proba[iN] = (sum_proba > 0) ? this->proba[iN] / sum_proba : 1.0 / N;
+	}
+	this->active_state = states;
+	this->state_position.assign(Nf, -1);
+	for (int iN=0; iN<N; iN++)
+	{
+		this->state_position[states[iN]] = iN;
+	}
+
+	// forward() and backward() only gather the columns of the active states
+	this->density_column.resize(N);
+	for (int iN=0; iN<N; iN++)
+	{
+		this->density_column[iN] = this->density_matrix + (size_t)states[iN] * this->T;
+	}
+	this->allocate_forward_backward(this->layout, this->memory);
+}
+
+void ScaleHMM::gather_densities(int tstart, DensityBlock& block)
+{
+	// Reading a short stretch of every column instead of one value per column and time point keeps the accesses sequential, the columns of R are T values apart
+	int tend = std::min(tstart + DENSITY_BLOCK, this->T);
 	for (int iN=0; iN<this->N; iN++)
 	{
-		// Do not use weights[iN] = ( this->sumgamma[iN] + this->gamma[iN][T-1] ) / this->T; here, since states are swapped and gammas not
-		double sum_over_gammas_per_state = 0;
-		for (int t=0; t<this->T; t++)
+		const double* column = this->density_column[iN];
+		for (int t=tstart; t<tend; t++)
 		{
-			sum_over_gammas_per_state += this->gamma[iN][t];
+			block.values[(size_t)(t - tstart) * this->N + iN] = column[t];
 		}
-		weights[iN] = sum_over_gammas_per_state / this->T;
 	}
+	block.start = tstart;
 }
 
-// Getters and Setters ----------------------------------------
-void ScaleHMM::get_posteriors(double** post)
+void ScaleHMM::multiply_factors()
 {
-	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	int N1 = this->kron_N1;
+	int N2 = this->kron_N2;
 	for (int iN=0; iN<this->N; iN++)
 	{
-		for (int t=0; t<this->T; t++)
+		for (int jN=0; jN<this->N; jN++)
 		{
-			post[iN][t] = this->gamma[iN][t];
+			this->A[iN][jN] = this->A1[(size_t)(iN/N2)*N1 + jN/N2] * this->A2[(size_t)(iN%N2)*N2 + jN%N2];
 		}
 	}
 }
 
-double ScaleHMM::get_posterior(int iN, int t)
-{
-	//FILE_LOG(logDEBUG4) << __PRETTY_FUNCTION__;
-	return(this->gamma[iN][t]);
-}
-
-double ScaleHMM::get_proba(int i)
-{
-	return( this->proba[i] );
-}
-
-double ScaleHMM::get_A(int i, int j)
-{
-	return( this->A[i][j] );
-}
-
-double ScaleHMM::get_logP()
+void ScaleHMM::find_runs()
 {
-	return( this->logP );
-}
+	// A run starts after the first time point of its segment and does not cross a checkpoint, so that forward_segment(), recompute_alpha_block() and backward_segment() reach its start and end bin by bin
+	this->run_start.clear();
+	this->run_end.clear();
+	this->run_value.clear();
+	this->segment_run.assign(this->num_segments + 1, 0);
+	std::vector<int> values;
+	int max_steps = 0;
+	for (int s=0; s<this->num_segments; s++)
+	{
+		this->segment_run[s] = this->run_start.size();
+		if (this->obs == NULL)
+		{
+			continue;
+		}
+		int tstart = this->segment_start[s];
+		int tend = this->segment_start[s+1];
+		int t0 = tstart + 1;
+		while (t0 < tend)
+		{
+			int t1 = t0;
+			while (t1+1 < tend && this->obs[t1+1] == this->obs[t0] && (this->memory != MEMORY_LOW || (t1+1 - tstart) % this->checkpoint_interval != 0))
+			{
+				t1++;
+			}
+			int steps = t1 - t0;
+			if (steps > 1 && steps > RUN_COST_RATIO * this->N * log2((double) steps))
+			{
+				this->run_start.push_back(t0);
+				this->run_end.push_back(t1);
+				int value = std::find(values.begin(), values.end(), this->obs[t0]) - values.begin();
+				if (value == (int) values.size())
+				{
+					values.push_back(this->obs[t0]);
+				}
+				this->run_value.push_back(value);
+				max_steps = std::max(max_steps, steps);
+			}
+			t0 = t1 + 1;
+		}
+	}
+	this->segment_run[this->num_segments] = this->run_start.size();
 
-void ScaleHMM::set_cutoff(int cutoff)
-{
-	this->cutoff = cutoff;
+	int ld = AlignedLength(this->N);
+	this->run_levels = 0;
+	while ((1 << this->run_levels) <= max_steps)
+	{
+		this->run_levels++;
+	}
+	this->run_powers.assign(values.size() * this->run_levels * this->N * ld, 0.0);
+	this->run_power_logscale.assign(values.size() * this->run_levels, 0.0);
+	this->run_beta.assign(this->run_start.size() * ld, 0.0);
+	this->runs_lumped = false;
 }
 
-// Private ====================================================
-// Methods ----------------------------------------------------
-void ScaleHMM::forward()
+void ScaleHMM::calc_run_powers()
 {
-	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-//	clock_t time = clock(), dtime;
-
-// 	if (not this->use_tdens)
-// 	{
-
-		std::vector<double> alpha(this->N);
-		// Initialization
-		this->scalefactoralpha[0] = 0.0;
-		for (int iN=0; iN<this->N; iN++)
+	int ld = AlignedLength(this->N);
+	size_t matrix_size = (size_t)this->N * ld;
+	int num_values = this->run_power_logscale.size() / this->run_levels;
+	std::vector<bool> done(num_values, false);
+	for (int r=0; r<(int)this->run_start.size(); r++)
+	{
+		int value = this->run_value[r];
+		if (done[value])
 		{
-			alpha[iN] = this->proba[iN] * this->densities[iN][0];
-			//FILE_LOG(logDEBUG4) << "alpha["<<iN<<"] = " << alpha[iN];
-			this->scalefactoralpha[0] += alpha[iN];
+			continue;
 		}
-		//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<0<<"] = " << scalefactoralpha[0];
+		done[value] = true;
+		// M[iN][jN] = A[iN][jN] * density of state jN, then square repeatedly
+		double* power = &this->run_powers[(size_t)value * this->run_levels * matrix_size];
+		double* logscale = &this->run_power_logscale[(size_t)value * this->run_levels];
+		const double* dens = this->densities[this->obs[this->run_start[r]]];
 		for (int iN=0; iN<this->N; iN++)
 		{
-			this->scalealpha[0][iN] = alpha[iN] / this->scalefactoralpha[0];
-			//FILE_LOG(logDEBUG4) << "scalealpha["<<0<<"]["<<iN<<"] = " << scalealpha[0][iN];
+			for (int jN=0; jN<this->N; jN++)
+			{
+				power[(size_t)iN * ld + jN] = this->A[iN][jN] * dens[jN];
+			}
+		}
+		logscale[0] = scale_to_max(power, this->N, ld);
+		for (int j=1; j<this->run_levels; j++)
+		{
+			matmul(power, power, this->N, ld, power + matrix_size);
+			power += matrix_size;
+			logscale[j] = 2 * logscale[j-1] + scale_to_max(power, this->N, ld);
 		}
-		// Induction
-		for (int t=1; t<this->T; t++)
+	}
+}
+
+double ScaleHMM::jump_alpha(int r, double* alpha)
+{
+	// alpha at the end of the run is alpha at its start times M^n, with one power per bit of n
+	int ld = AlignedLength(this->N);
+	size_t matrix_size = (size_t)this->N * ld;
+	const double* power = &this->run_powers[(size_t)this->run_value[r] * this->run_levels * matrix_size];
+	const double* logscale = &this->run_power_logscale[(size_t)this->run_value[r] * this->run_levels];
+	int steps = this->run_end[r] - this->run_start[r];
+	std::vector<double> helpsum(ld);
+	double logsum = 0.0;
+	for (int j=0; (steps >> j) > 0; j++)
+	{
+		if ((steps >> j) & 1)
 		{
-			this->scalefactoralpha[t] = 0.0;
+			this->matvec(alpha, power + j * matrix_size, ld, this->N, &helpsum[0]);
+			double sum = 0.0;
 			for (int iN=0; iN<this->N; iN++)
 			{
-				double helpsum = 0.0;
-				for (int jN=0; jN<this->N; jN++)
-				{
-					helpsum += this->scalealpha[t-1][jN] * this->A[jN][iN];
-				}
-				alpha[iN] = helpsum * this->densities[iN][t];
-				//FILE_LOG(logDEBUG4) << "alpha["<<iN<<"] = " << alpha[iN];
-				this->scalefactoralpha[t] += alpha[iN];
+				sum += helpsum[iN];
 			}
-			//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<t<<"] = " << scalefactoralpha[t];
 			for (int iN=0; iN<this->N; iN++)
 			{
-				this->scalealpha[t][iN] = alpha[iN] / this->scalefactoralpha[t];
-				//FILE_LOG(logDEBUG4) << "scalealpha["<<t<<"]["<<iN<<"] = " << scalealpha[t][iN];
-				if(std::isnan(this->scalealpha[t][iN]))
-				{
-					//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
-					for (int jN=0; jN<this->N; jN++)
-					{
-						//FILE_LOG(logERROR) << "scalealpha["<<t-1<<"]["<<jN<<"] = " << scalealpha[t-1][jN];
-						//FILE_LOG(logERROR) << "A["<<iN<<"]["<<jN<<"] = " << A[iN][jN];
-					}
-					//FILE_LOG(logERROR) << "scalefactoralpha["<<t<<"] = "<<scalefactoralpha[t] << ", densities = "<<densities[iN][t];
-					//FILE_LOG(logERROR) << "scalealpha["<<t<<"]["<<iN<<"] = " << scalealpha[t][iN];
-					throw nan_detected;
-				}
+				alpha[iN] = helpsum[iN] / sum;
 			}
+			logsum += log(sum) + logscale[j];
 		}
-
-// 	}
-// 	else if (this->use_tdens)
-// 	{
-// 
-// 		double alpha [this->N];
-// 		// Initialization
-// 		this->scalefactoralpha[0] = 0.0;
-// 		for (int iN=0; iN<this->N; iN++)
-// 		{
-// 			alpha[iN] = this->proba[iN] * this->tdensities[0][iN];
-// 			//FILE_LOG(logDEBUG4) << "alpha["<<iN<<"] = " << alpha[iN];
-// 			this->scalefactoralpha[0] += alpha[iN];
-// 		}
-// 		//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<0<<"] = " << scalefactoralpha[0];
-// 		for (int iN=0; iN<this->N; iN++)
-// 		{
-// 			this->scalealpha[0][iN] = alpha[iN] / this->scalefactoralpha[0];
-// 			//FILE_LOG(logDEBUG4) << "scalealpha["<<0<<"]["<<iN<<"] = " << scalealpha[0][iN];
-// 		}
-// 		// Induction
-// 		for (int t=1; t<this->T; t++)
-// 		{
-// 			this->scalefactoralpha[t] = 0.0;
-// 			for (int iN=0; iN<this->N; iN++)
-// 			{
-// 				double helpsum = 0.0;
-// 				for (int jN=0; jN<this->N; jN++)
-// 				{
-// 					helpsum += this->scalealpha[t-1][jN] * this->A[jN][iN];
-// 				}
-// 				alpha[iN] = helpsum * this->tdensities[t][iN];
-// 				//FILE_LOG(logDEBUG4) << "alpha["<<iN<<"] = " << alpha[iN];
-// 				this->scalefactoralpha[t] += alpha[iN];
-// 			}
-// 			//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<t<<"] = " << scalefactoralpha[t];
-// 			for (int iN=0; iN<this->N; iN++)
-// 			{
-// 				this->scalealpha[t][iN] = alpha[iN] / this->scalefactoralpha[t];
-// 				//FILE_LOG(logDEBUG4) << "scalealpha["<<t<<"]["<<iN<<"] = " << scalealpha[t][iN];
-// 				if(std::isnan(this->scalealpha[t][iN]))
-// 				{
-// 					//FILE_LOG(logWARNING) << __PRETTY_FUNCTION__;
-// 					for (int jN=0; jN<this->N; jN++)
-// 					{
-// 						//FILE_LOG(logWARNING) << "scalealpha["<<t-1<<"]["<<jN<<"] = " << scalealpha[t-1][jN];
-// 						//FILE_LOG(logWARNING) << "A["<<iN<<"]["<<jN<<"] = " << A[iN][jN];
-// 					}
-// 					//FILE_LOG(logWARNING) << "scalefactoralpha["<<t<<"] = "<<scalefactoralpha[t] << ", tdensities = "<<tdensities[t][iN];
-// 					//FILE_LOG(logWARNING) << "scalealpha["<<t<<"]["<<iN<<"] = " << scalealpha[t][iN];
-// 					exit(1);
-// 				}
-// 			}
-// 		}
-// 
-// 	}
-
-//	dtime = clock() - time;
-//	//FILE_LOG(logDEBUG) << "forward(): " << dtime << " clicks";
+	}
+	return(logsum);
 }
 
-void ScaleHMM::backward()
+void ScaleHMM::jump_beta(int r, const double* alpha_start, double* beta, double* sumxi_s, double* sumgamma_run)
 {
-	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-//	clock_t time = clock(), dtime;
-
-// 	if (not this->use_tdens)
-// 	{
-
-		std::vector<double> beta(this->N);
-		// Initialization
-		for (int iN=0; iN<this->N; iN++)
-		{
-			beta[iN] = 1.0;
-			//FILE_LOG(logDEBUG4) << "beta["<<iN<<"] = " << beta[iN];
-		}
-		//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<T-1<<"] = " << scalefactoralpha[T-1];
-		for (int iN=0; iN<this->N; iN++)
+	// With a = alpha at the start t0, b = beta at the end and n steps, the run contributes xi_k[iN][jN] = (a M^k)[iN] * A[iN][jN] * dens[jN] * (M^(n-1-k) b)[jN] / Z for k = 0..n-1, with Z = a M^n b.
+	// The sum over k is the transpose of X_n = sum_k M^k (b a) M^(n-1-k), the upper right block of [[M, b a], [0, M]]^n, computed by doubling with X_(m1+m2) = M^m1 X_m2 + X_m1 M^m2.
+	int ld = AlignedLength(this->N);
+	size_t matrix_size = (size_t)this->N * ld;
+	const double* power = &this->run_powers[(size_t)this->run_value[r] * this->run_levels * matrix_size];
+	const double* logscale = &this->run_power_logscale[(size_t)this->run_value[r] * this->run_levels];
+	const double* dens = this->densities[this->obs[this->run_start[r]]];
+	int steps = this->run_end[r] - this->run_start[r];
+
+	// X_1 = b a
+	std::vector<double> X(matrix_size, 0.0), Xsum(matrix_size, 0.0), Macc(matrix_size, 0.0), help1(matrix_size), help2(matrix_size);
+	for (int iN=0; iN<this->N; iN++)
+	{
+		for (int jN=0; jN<this->N; jN++)
 		{
-			this->scalebeta[T-1][iN] = beta[iN] / this->scalefactoralpha[T-1];
-			//FILE_LOG(logDEBUG4) << "scalebeta["<<T-1<<"]["<<iN<<"] = " << scalebeta[T-1][iN];
+			X[(size_t)iN * ld + jN] = beta[iN] * alpha_start[jN];
 		}
-		// Induction
-		for (int t=this->T-2; t>=0; t--)
+	}
+	double logX = scale_to_max(&X[0], this->N, ld);
+	double logXsum = 0.0;
+	double logMacc = 0.0;
+	bool empty = true;
+	// M^n b
+	std::vector<double> w(beta, beta + ld);
+	double logw = 0.0;
+	for (int j=0; (steps >> j) > 0; j++)
+	{
+		const double* Mj = power + j * matrix_size;
+		if ((steps >> j) & 1)
 		{
+			double sum = 0.0;
 			for (int iN=0; iN<this->N; iN++)
 			{
-				beta[iN] = 0.0;
-				for(int jN=0; jN<this->N; jN++)
+				help1[iN] = 0.0;
+				for (int jN=0; jN<this->N; jN++)
 				{
-					beta[iN] += this->A[iN][jN] * this->densities[jN][t+1] * this->scalebeta[t+1][jN];
+					help1[iN] += Mj[(size_t)iN * ld + jN] * w[jN];
 				}
-				//FILE_LOG(logDEBUG4) << "beta["<<iN<<"] = " << beta[iN];
+				sum += help1[iN];
 			}
-			//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<t<<"] = " << scalefactoralpha[t];
 			for (int iN=0; iN<this->N; iN++)
 			{
-				this->scalebeta[t][iN] = beta[iN] / this->scalefactoralpha[t];
-				//FILE_LOG(logDEBUG4) << "scalebeta["<<t<<"]["<<iN<<"] = " << scalebeta[t][iN];
-				if (std::isnan(this->scalebeta[t][iN]))
+				w[iN] = help1[iN] / sum;
+			}
+			logw += log(sum) + logscale[j];
+
+			if (empty)
+			{
+				Xsum = X;
+				logXsum = logX;
+				std::copy(Mj, Mj + matrix_size, Macc.begin());
+				logMacc = logscale[j];
+				empty = false;
+			}
+			else
+			{
+				// Xsum = Macc X + Xsum Mj, Macc = Macc Mj
+				matmul(&Macc[0], &X[0], this->N, ld, &help1[0]);
+				matmul(&Xsum[0], Mj, this->N, ld, &help2[0]);
+				double log1 = logMacc + logX;
+				double log2 = logXsum + logscale[j];
+				logXsum = std::max(log1, log2);
+				double f1 = exp(log1 - logXsum);
+				double f2 = exp(log2 - logXsum);
+				for (size_t i=0; i<matrix_size; i++)
 				{
-					//FILE_LOG(logERROR) << __PRETTY_FUNCTION__;
-					for (int jN=0; jN<this->N; jN++)
-					{
-						//FILE_LOG(logERROR) << "scalebeta["<<jN<<"]["<<t+1<<"] = " << scalebeta[t+1][jN];
-						//FILE_LOG(logERROR) << "A["<<iN<<"]["<<jN<<"] = " << A[iN][jN];
-						//FILE_LOG(logERROR) << "densities["<<jN<<"]["<<t+1<<"] = " << densities[jN][t+1];
-					}
-					//FILE_LOG(logERROR) << "this->scalefactoralpha[t]["<<t<<"] = "<<this->scalefactoralpha[t] << ", densities = "<<densities[iN][t];
-					//FILE_LOG(logERROR) << "scalebeta["<<iN<<"]["<<t<<"] = " << scalebeta[t][iN];
-					throw nan_detected;
+					Xsum[i] = f1 * help1[i] + f2 * help2[i];
 				}
+				logXsum += scale_to_max(&Xsum[0], this->N, ld);
+				matmul(&Macc[0], Mj, this->N, ld, &help1[0]);
+				Macc = help1;
+				logMacc += logscale[j] + scale_to_max(&Macc[0], this->N, ld);
 			}
 		}
+		if ((steps >> (j+1)) > 0)
+		{
+			// X_(2m) = M^m X_m + X_m M^m
+			matmul(Mj, &X[0], this->N, ld, &help1[0]);
+			matmul(&X[0], Mj, this->N, ld, &help2[0]);
+			for (size_t i=0; i<matrix_size; i++)
+			{
+				X[i] = help1[i] + help2[i];
+			}
+			logX += logscale[j] + scale_to_max(&X[0], this->N, ld);
+		}
+	}
 
-// 	}
-// 	else if (this->use_tdens)
-// 	{
-// 
-// 		double beta [this->N];
-// 		// Initialization
-// 		for (int iN=0; iN<this->N; iN++)
-// 		{
-// 			beta[iN] = 1.0;
-// 			//FILE_LOG(logDEBUG4) << "beta["<<iN<<"] = " << beta[iN];
-// 		}
-// 		//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<T-1<<"] = " << scalefactoralpha[T-1];
-// 		for (int iN=0; iN<this->N; iN++)
-// 		{
-// 			this->scalebeta[T-1][iN] = beta[iN] / this->scalefactoralpha[T-1];
-// 			//FILE_LOG(logDEBUG4) << "scalebeta["<<T-1<<"]["<<iN<<"] = " << scalebeta[T-1][iN];
-// 		}
-// 		// Induction
-// 		for (int t=this->T-2; t>=0; t--)
-// 		{
-// 			for (int iN=0; iN<this->N; iN++)
-// 			{
-// 				//FILE_LOG(logDEBUG4) << "Calculating backward variable for state " << iN;
-// 				beta[iN] = 0.0;
-// 				for(int jN=0; jN<this->N; jN++)
-// 				{
-// 					beta[iN] += this->A[iN][jN] * this->tdensities[t+1][jN] * this->scalebeta[t+1][jN];
-// 				}
-// 			}
-// 			//FILE_LOG(logDEBUG4) << "scalefactoralpha["<<t<<"] = " << scalefactoralpha[t];
-// 			for (int iN=0; iN<this->N; iN++)
-// 			{
-// 				this->scalebeta[t][iN] = beta[iN] / this->scalefactoralpha[t];
-// 				//FILE_LOG(logDEBUG4) << "scalebeta["<<t<<"]["<<iN<<"] = " << scalebeta[t][iN];
-// 				if (std::isnan(this->scalebeta[t][iN]))
-// 				{
-// 					//FILE_LOG(logWARNING) << __PRETTY_FUNCTION__;
-// 					for (int jN=0; jN<this->N; jN++)
-// 					{
-// 						//FILE_LOG(logWARNING) << "scalebeta["<<jN<<"]["<<t+1<<"] = " << scalebeta[t+1][jN];
-// 						//FILE_LOG(logWARNING) << "A["<<iN<<"]["<<jN<<"] = " << A[iN][jN];
-// 						//FILE_LOG(logWARNING) << "tdensities["<<t+1<<"]["<<jN<<"] = " << tdensities[t+1][jN];
-// 					}
-// 					//FILE_LOG(logWARNING) << "this->scalefactoralpha[t]["<<t<<"] = "<<this->scalefactoralpha[t] << ", tdensities = "<<densities[t][iN];
-// 					//FILE_LOG(logWARNING) << "scalebeta["<<iN<<"]["<<t<<"] = " << scalebeta[t][iN];
-// 					exit(1);
-// 				}
-// 			}
-// 		}
-// 
-// 	}
-
-//	dtime = clock() - time;
-//	//FILE_LOG(logDEBUG) << "backward(): " << dtime << " clicks";
-}
-
-void ScaleHMM::calc_sumgamma()
-{
-	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-//	clock_t time = clock(), dtime;
-
-	// Initialize the sumgamma
+	// Z = a M^n b
+	double Z = 0.0;
 	for (int iN=0; iN<this->N; iN++)
 	{
-		this->sumgamma[iN] = 0.0;
+		Z += alpha_start[iN] * w[iN];
 	}
-
-	// Compute the gammas (posteriors) and sumgamma
-	#pragma omp parallel for
+	double factor = exp(logXsum - logw) / Z;
 	for (int iN=0; iN<this->N; iN++)
 	{
-		for (int t=0; t<this->T; t++)
+		sumgamma_run[iN] = 0.0;
+		double* sumxi_i = sumxi_s + (size_t)iN * ld;
+		for (int jN=0; jN<this->N; jN++)
 		{
-			this->gamma[iN][t] = this->scalealpha[t][iN] * this->scalebeta[t][iN] * this->scalefactoralpha[t];
-			this->sumgamma[iN] += this->gamma[iN][t];
+			double xi = factor * Xsum[(size_t)jN * ld + iN] * dens[jN];
+			sumxi_i[jN] += xi;
+			sumgamma_run[iN] += xi * this->A[iN][jN];
 		}
 	}
-	// Subtract the last value because sumgamma goes only until T-1 and we computed until T to get also loggamma at T
+	// beta at the start of the run is M^n b, scaled so that the posteriors at t0 sum to 1
+	double scalefactor = this->scalefactoralpha[this->run_start[r]] * Z;
 	for (int iN=0; iN<this->N; iN++)
 	{
-		this->sumgamma[iN] -= this->gamma[iN][T-1];
+		beta[iN] = w[iN] / scalefactor;
+		if (std::isnan(beta[iN]) || std::isnan(sumgamma_run[iN]))
+		{
+			throw nan_detected;
+		}
 	}
-
-//	dtime = clock() - time;
-//	//FILE_LOG(logDEBUG) << "calc_sumgamma(): " << dtime << " clicks";
 }
 
-void ScaleHMM::calc_sumxi()
+void ScaleHMM::expand_runs()
 {
-	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
-//	clock_t time = clock(), dtime;
-
-	double xi;
-	// Initialize the sumxi
-	for (int iN=0; iN<this->N; iN++)
+	// The posteriors of the time points t0..t1-1 of a run follow from alpha at t0 and beta at t1 with the A and densities of the last baumWelch()
+	int ld = AlignedLength(this->N);
+	this->reserve_alpha_blocks();
+	std::vector<int> thread_error(this->num_segments, THREAD_OK);
+	#pragma omp parallel for schedule(dynamic)
+	for (int s=0; s<this->num_segments; s++)
 	{
-		for (int jN=0; jN<this->N; jN++)
-		{
-			this->sumxi[iN][jN] = 0.0;
-		}
-	}	
-
-	// Compute the sumxi
-// 	if (not this->use_tdens)
-// 	{
-
-		#pragma omp parallel for
-		for (int iN=0; iN<this->N; iN++)
+		try
 		{
-			//FILE_LOG(logDEBUG3) << "Calculating sumxi["<<iN<<"][jN]";
-			for (int t=0; t<this->T-1; t++)
+			std::vector<double> alpha_t(ld), help(ld), densbeta(ld);
+			for (int r=this->segment_run[s]; r<this->segment_run[s+1]; r++)
 			{
-				for (int jN=0; jN<this->N; jN++)
+				int t0 = this->run_start[r];
+				int t1 = this->run_end[r];
+				const double* dens = this->densities[this->obs[t0]];
+				// Backward variables (unscaled up to a constant) into gamma
+				std::vector<double> beta(&this->run_beta[(size_t)r * ld], &this->run_beta[(size_t)r * ld] + ld);
+				for (int t=t1-1; t>=t0; t--)
+				{
+					for (int jN=0; jN<this->N; jN++)
+					{
+						densbeta[jN] = dens[jN] * beta[jN];
+					}
+					this->matvec(&densbeta[0], this->At[0], ld, this->N, &beta[0]);
+					double sum = 0.0;
+					for (int iN=0; iN<this->N; iN++)
+					{
+						sum += beta[iN];
+					}
+					for (int iN=0; iN<this->N; iN++)
+					{
+						beta[iN] /= sum;
+						this->gamma[iN][t] = beta[iN];
+					}
+				}
+				// Multiply with the forward variables and normalize
+				this->get_alpha(s, t0, &alpha_t[0]);
+				for (int t=t0; t<t1; t++)
 				{
-					xi = this->scalealpha[t][iN] * this->A[iN][jN] * this->densities[jN][t+1] * this->scalebeta[t+1][jN];
-					this->sumxi[iN][jN] += xi;
+					if (t > t0)
+					{
+						this->matvec(&alpha_t[0], this->A[0], ld, this->N, &help[0]);
+						double sum = 0.0;
+						for (int iN=0; iN<this->N; iN++)
+						{
+							alpha_t[iN] = help[iN] * dens[iN];
+							sum += alpha_t[iN];
+						}
+						for (int iN=0; iN<this->N; iN++)
+						{
+							alpha_t[iN] /= sum;
+						}
+					}
+					double sum = 0.0;
+					for (int iN=0; iN<this->N; iN++)
+					{
+						this->gamma[iN][t] *= alpha_t[iN];
+						sum += this->gamma[iN][t];
+					}
+					for (int iN=0; iN<this->N; iN++)
+					{
+						this->gamma[iN][t] /= sum;
+					}
 				}
 			}
 		}
-
-// 	}
-// 	else if (this->use_tdens)
-// 	{
-// 
-// 		#pragma omp parallel for
-// 		for (int iN=0; iN<this->N; iN++)
-// 		{
-// 			//FILE_LOG(logDEBUG3) << "Calculating sumxi["<<iN<<"][jN]";
-// 			for (int t=0; t<this->T-1; t++)
-// 			{
-// 				for (int jN=0; jN<this->N; jN++)
-// 				{
-// 					xi = this->scalealpha[t][iN] * this->A[iN][jN] * this->tdensities[t+1][jN] * this->scalebeta[t+1][jN];
-// 					this->sumxi[iN][jN] += xi;
-// 				}
-// 			}
-// 		}
-// 
-// 	}
-
-//	dtime = clock() - time;
-//	//FILE_LOG(logDEBUG) << "calc_sumxi(): " << dtime << " clicks";
+		catch(...)
+		{
+			thread_error[s] = current_thread_error();
+		}
+	}
+	rethrow_thread_errors(thread_error);
+	this->runs_lumped = false;
 }
 
 void ScaleHMM::calc_loglikelihood()
@@ -782,72 +2329,162 @@ void ScaleHMM::calc_loglikelihood()
 //	//FILE_LOG(logDEBUG) << "calc_loglikelihood(): " << dtime << " clicks";
 }
 
+EmissionLayout ScaleHMM::get_emission_layout()
+{
+	int iN = 0;
+	bool zero_inflation = false;
+	bool geometric = false;
+	if (iN < this->N && this->densityFunctions[iN]->get_name() == ZERO_INFLATION)
+	{
+		zero_inflation = true;
+		iN++;
+	}
+	if (iN < this->N && this->densityFunctions[iN]->get_name() == GEOMETRIC)
+	{
+		geometric = true;
+		iN++;
+	}
+	if (iN == this->N)
+	{
+		return(EMISSION_GENERIC);
+	}
+	for (; iN<this->N; iN++)
+	{
+		if (this->densityFunctions[iN]->get_name() != NEGATIVE_BINOMIAL)
+		{
+			return(EMISSION_GENERIC);
+		}
+	}
+	if (zero_inflation && geometric) return(EMISSION_ZI_GEOM_NB);
+	if (zero_inflation) return(EMISSION_ZI_NB);
+	if (geometric) return(EMISSION_GEOM_NB);
+	return(EMISSION_NB);
+}
+
 void ScaleHMM::calc_densities()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 //	clock_t time = clock(), dtime;
-	// Errors thrown inside a #pragma must be handled inside the thread
-	std::vector<bool> nan_encountered(this->N);
+	switch (this->get_emission_layout())
+	{
+		case EMISSION_NB: this->calc_densities_tied<false,false>(); break;
+		case EMISSION_ZI_NB: this->calc_densities_tied<true,false>(); break;
+		case EMISSION_GEOM_NB: this->calc_densities_tied<false,true>(); break;
+		case EMISSION_ZI_GEOM_NB: this->calc_densities_tied<true,true>(); break;
+		default: this->calc_densities_generic(); break;
+	}
+	this->correct_zero_densities();
+
+//	dtime = clock() - time;
+//	//FILE_LOG(logDEBUG) << "calc_densities(): " << dtime << " clicks";
+}
+
+void ScaleHMM::calc_densities_generic()
+{
+	// Densities depend only on the read count, so each state fills one row of read counts 0..max_obs
+	int ld = AlignedLength(this->max_obs+1);
+	std::vector<double> dens_per_read((size_t)this->N * ld);
+	// Errors thrown inside a #pragma must be handled inside the thread, std::vector<bool> packs bits and cannot be written concurrently
+	std::vector<int> thread_error(this->N, THREAD_OK);
 	#pragma omp parallel for
 	for (int iN=0; iN<this->N; iN++)
 	{
 		//FILE_LOG(logDEBUG3) << "Calculating densities for state " << iN;
 		try
 		{
-			this->densityFunctions[iN]->calc_densities(this->densities[iN]);
+			this->densityFunctions[iN]->calc_densities_per_read(&dens_per_read[(size_t)iN * ld], this->max_obs);
 		}
-		catch(std::exception& e)
+		catch(...)
 		{
-			if (strcmp(e.what(),"nan detected")==0) { nan_encountered[iN]=true; }
-			else { throw; }
+			thread_error[iN] = current_thread_error();
 		}
 	}
-	for (int iN=0; iN<this->N; iN++)
+	rethrow_thread_errors(thread_error);
+
+	// Transpose, so that forward() and backward() read the densities of all states at obs[t] from one row
+	for (int j=0; j<=this->max_obs; j++)
 	{
-		if (nan_encountered[iN]==true)
+		for (int iN=0; iN<this->N; iN++)
 		{
-			throw nan_detected;
+			this->densities[j][iN] = dens_per_read[(size_t)iN * ld + j];
 		}
 	}
+}
 
-	// Check if the density for all states is numerically zero and correct to prevent NaNs
-	std::vector<double> temp(this->N);
-	// t=0
-	for (int iN=0; iN<this->N; iN++)
+template<bool HasZeroInflation, bool HasGeometric>
+void ScaleHMM::calc_densities_tied()
+{
+	// Same operations as calc_densities_per_read() of the single densities, but written row by row into the table
+	const int first_nb = (int)HasZeroInflation + (int)HasGeometric;
+	const int num_nb = this->N - first_nb;
+	const int ld = this->max_obs+1;
+	double p = 0.0, oneminusp = 0.0;
+	if (HasGeometric)
 	{
-		temp[iN] = this->densities[iN][0];
+		p = static_cast<Geometric*>(this->densityFunctions[first_nb-1])->get_prob();
+		oneminusp = 1-p;
 	}
-	if (*std::max_element(temp.begin(), temp.end()) == 0.0)
+	std::vector<double> lGammaRplusJ((size_t)num_nb * ld);
+	std::vector<double> lGammaR(num_nb);
+	std::vector<double> sizelogp(num_nb);
+	std::vector<double> log1minusp(num_nb);
+	double* lxfactorials = NULL;
+	for (int k=0; k<num_nb; k++)
 	{
-		for (int iN=0; iN<this->N; iN++)
-		{
-			this->densities[iN][0] = 0.00000000001;
-		}
+		NegativeBinomial* d = static_cast<NegativeBinomial*>(this->densityFunctions[first_nb+k]);
+		lgamma_table(d->get_size(), this->max_obs, &lGammaRplusJ[(size_t)k * ld]);
+		lGammaR[k] = lgamma(d->get_size());
+		sizelogp[k] = d->get_size() * log(d->get_prob());
+		log1minusp[k] = log(1-d->get_prob());
+		lxfactorials = d->get_lxfactorials(); // all states have the same observations
 	}
-	// t>0
-	for (int t=1; t<this->T; t++)
+	for (int j=0; j<=this->max_obs; j++)
 	{
+		double* row = this->densities[j];
+		if (HasZeroInflation)
+		{
+			row[0] = (j == 0) ? 1.0 : 0.0;
+		}
+		if (HasGeometric)
+		{
+			row[first_nb-1] = p * pow(oneminusp,j);
+		}
+		for (int k=0; k<num_nb; k++)
+		{
+			row[first_nb+k] = exp( lGammaRplusJ[(size_t)k * ld + j] - lGammaR[k] - lxfactorials[j] + sizelogp[k] + j * log1minusp[k] );
+		}
 		for (int iN=0; iN<this->N; iN++)
 		{
-			temp[iN] = this->densities[iN][t];
+			if (std::isnan(row[iN]))
+			{
+				//FILE_LOG(logERROR) << "densities["<<j<<"]["<<iN<<"] = "<< row[iN];
+				throw nan_detected;
+			}
 		}
-		if (*std::max_element(temp.begin(), temp.end()) == 0.0)
+	}
+}
+
+void ScaleHMM::correct_zero_densities()
+{
+	// Check if the density for all states is numerically zero and correct to prevent NaNs
+	// Such read counts get the densities of the next lower read count
+	for (int j=0; j<=this->max_obs; j++)
+	{
+		if (*std::max_element(this->densities[j], this->densities[j] + this->N) == 0.0)
 		{
 			for (int iN=0; iN<this->N; iN++)
 			{
-				this->densities[iN][t] = this->densities[iN][t-1];
+				this->densities[j][iN] = (j == 0) ? 0.00000000001 : this->densities[j-1][iN];
 			}
 		}
 	}
-
-//	dtime = clock() - time;
-//	//FILE_LOG(logDEBUG) << "calc_densities(): " << dtime << " clicks";
 }
 
 void ScaleHMM::print_uni_iteration(int iteration)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	this->EMTime_real = difftime(time(NULL),this->EMStartTime_sec);
+	if (this->quiet) { return; }
 	int bs = 106;
 	char buffer [106];
 	if (iteration % 20 == 0)
@@ -856,17 +2493,26 @@ void ScaleHMM::print_uni_iteration(int iteration)
 		//FILE_LOG(logITERATION) << buffer;
 		Rprintf("%s\n", buffer);
 	}
+	char diff [21];
+	if (this->posterior_diff)
+	{
+		snprintf(diff, 21, "%*f", 20, this->sumdiff_posterior);
+	}
+	else
+	{
+		snprintf(diff, 21, "%20s", "-");
+	}
 	if (iteration == 0)
 	{
 		snprintf(buffer, bs, "%10s%20s%20s%20s%*d", "0", "-inf", "-", "-", 15, this->EMTime_real);
 	}
 	else if (iteration == 1)
 	{
-		snprintf(buffer, bs, "%*d%*f%20s%*f%*d", 10, iteration, 20, this->logP, "inf", 20, this->sumdiff_posterior, 15, this->EMTime_real);
+		snprintf(buffer, bs, "%*d%*f%20s%20s%*d", 10, iteration, 20, this->logP, "inf", diff, 15, this->EMTime_real);
 	}
 	else
 	{
-		snprintf(buffer, bs, "%*d%*f%*f%*f%*d", 10, iteration, 20, this->logP, 20, this->dlogP, 20, this->sumdiff_posterior, 15, this->EMTime_real);
+		snprintf(buffer, bs, "%*d%*f%*f%20s%*d", 10, iteration, 20, this->logP, 20, this->dlogP, diff, 15, this->EMTime_real);
 	}
 	//FILE_LOG(logITERATION) << buffer;
 	Rprintf("%s\n", buffer);
@@ -879,6 +2525,7 @@ void ScaleHMM::print_multi_iteration(int iteration)
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
 	this->EMTime_real = difftime(time(NULL),this->EMStartTime_sec);
+	if (this->quiet) { return; }
 	int bs = 86;
 	char buffer [86];
 	if (iteration % 20 == 0)
@@ -909,6 +2556,7 @@ void ScaleHMM::print_multi_iteration(int iteration)
 void ScaleHMM::print_uni_params()
 {
 	//FILE_LOG(logDEBUG2) << __PRETTY_FUNCTION__;
+	if (this->quiet) { return; }
 	int bs = 82;
 	char buffer [82];
 	int cx;
@@ -6,11 +6,19 @@
 
 #include "utility.h"
 #include "densities.h"
+#include "kernels.h"
 #include <cmath>
 #include <R.h> // R_CheckUserInterrupt()
 #include <vector> // storing density functions
 #include <time.h> // time(), difftime()
 #include <string> // strcmp
+#include <algorithm> // std::lower_bound, std::find
+#include <new> // std::bad_alloc
+#include <stdexcept> // std::runtime_error
+
+#ifdef _OPENMP
+#include <omp.h> // omp_get_thread_num(), only if R was built with OpenMP support
+#endif
 
 // #if defined TARGET_OS_MAC || defined __APPLE__
 // #include <libiomp/omp.h> // parallelization options on mac
@@ -18,12 +26,25 @@
 // #include <omp.h> // parallelization options
 // #endif
 
+/* state families of the univariate HMM. [zero-inflation] [geometric] negative binomials with tied parameters is the layout of findCNVs() and has its own code path without virtual calls */
+enum EmissionLayout {EMISSION_GENERIC, EMISSION_NB, EMISSION_ZI_NB, EMISSION_GEOM_NB, EMISSION_ZI_GEOM_NB};
+
+#define DENSITY_BLOCK 16 ///< number of consecutive time points whose multivariate densities are gathered from their columns at once
+
+/* densities of all states for a block of time points, gathered from the column-major densities of the multivariate HMM so that each column is read sequentially */
+struct DensityBlock
+{
+	std::vector<double> values; ///< [DENSITY_BLOCK x N] densities, one row per time point
+	int start; ///< first time point in values, -1 if none
+	DensityBlock(int N) : values((size_t)DENSITY_BLOCK * N), start(-1) {}
+};
+
 class ScaleHMM  {
 
 	public:
 		// Constructor and Destructor
-		ScaleHMM(int T, int N);
-		ScaleHMM(int T, int N, int Nmod, double** densities);
+		ScaleHMM(int* observations, int T, int N, MatrixLayout layout=TIME_MAJOR, MemoryMode memory=MEMORY_FULL);
+		ScaleHMM(int T, int N, int Nmod, const double* densities, MatrixLayout layout=TIME_MAJOR, MemoryMode memory=MEMORY_FULL); ///< densities is a column-major matrix [T x N] as stored by R, owned by the caller and not copied
 		~ScaleHMM();
 
 		// Member variables
@@ -33,22 +54,40 @@ class ScaleHMM  {
 		void initialize_transition_probs(double* initial_A, bool use_initial_params);
 		void initialize_proba(double* initial_proba, bool use_initial_params);
 		void baumWelch();
+		void viterbi(); ///< most likely state sequence for the current parameters (max-product), no posteriors are computed
 		void EM(int* maxiter, int* maxtime, double* eps);
+		void resume_EM(int* maxiter, int* maxtime, double* eps); ///< continue a previous EM() that stopped at maxiter or maxtime, the limits count from its start
 		std::vector<double> calc_weights();
-		void calc_weights(double* weights);
+		void calc_weights(double* weights); ///< mean posterior of each state, indexed as before pruning and 0 for pruned states
 
 		// Getters and Setters
-		void get_posteriors(double** post);
+		void get_posteriors(double** post); ///< posteriors [N x T], states indexed as before pruning
 		double get_posterior(int iN, int t);
 		double get_proba(int i);
 		double get_A(int i, int j);
 		double get_logP();
+		double get_posterior_diff(); ///< sum of the differences in posteriors between the last two Baum-Welch runs, only if set_posterior_diff(true)
+		int get_viterbi_state(int t); ///< state index of time point t in the sequence of the last viterbi()
+		double get_viterbi_logP(); ///< joint log-probability of the observations and the sequence of the last viterbi()
 		void set_cutoff(int cutoff);
+		void set_segments(int num_segments, int* segment_starts);
+		void set_observations(int* observations, int T, int num_segments, int* segment_starts); ///< univariate: decode or fit another sequence with the same parameters, e.g. the next cell. The density functions are rebound, its counts must not exceed the max_obs they were created with. The buffers are reused and grow if needed
+		void set_quiet(bool quiet);
+		void set_interruptible(bool interruptible);
+		void set_acceleration(bool accelerate);
+		void set_iteration_limit(int maxiter); ///< the EM runs in rounds of EM() and resume_EM() with smaller maxiter, maxiter is the limit of all rounds together for which SQUAREM plans its extrapolations
+		void set_posterior_diff(bool posterior_diff); ///< compute the difference in posteriors between iterations for the iteration output (off by default)
+		void set_pruning(double threshold); ///< multivariate: drop states whose fraction of the posterior mass falls below threshold from the EM, not together with set_kronecker()
+		void restore_states(); ///< re-admit the pruned states with the parameters they had when they were dropped
+		bool is_pruned(int i); ///< state i was dropped during the EM
+		void set_kronecker(int N1); ///< multivariate: model A as the Kronecker product of a [N1 x N1] and a [N/N1 x N/N1] transition matrix, combined state iN = i1*(N/N1) + i2. Call before initialize_transition_probs()
 
 	private:
 		// Member variables
 		int T; ///< length of observed sequence
-		int N; ///< number of states
+		int T_capacity; ///< number of time points that scalefactoralpha and gamma have room for
+		int N; ///< number of states (active states if states were pruned)
+		int N_full; ///< number of states including the pruned ones
 		int Nmod; ///< number of modifications / marks
 		int cutoff; ///< a cutoff for observations
 		double* sumgamma; ///< vector[N] of sum of posteriors (gamma values)
@@ -57,26 +96,133 @@ class ScaleHMM  {
 		double logP; ///< loglikelihood
 		double dlogP; ///< difference in loglikelihood from one iteration to the next
 		double** A; ///< matrix [N x N] of transition probabilities
+		double** At; ///< transpose of A, so that backward() can stream contiguous rows
+		double prune_threshold; ///< states whose fraction of the posterior mass is below this value are pruned after a parameter update, 0 to keep all states
+		std::vector<int> active_state; ///< vector[N] original index of each active state
+		std::vector<int> state_position; ///< vector[N_full] position of each original state among the active states, -1 if it is pruned
+		std::vector<int> pruned; ///< vector[N_full] 1 if the state was pruned at some point
+		std::vector<double> full_A; ///< [N_full x N_full] transition probabilities of all states from the last time they were active
+		std::vector<double> full_proba; ///< vector[N_full] initial probabilities of all states from the last time they were active
+		const double* density_matrix; ///< multivariate: the caller's column-major matrix [T x N_full] of density values
+		std::vector<const double*> density_column; ///< multivariate: vector[N] column of each active state in density_matrix
+		int kron_N1; ///< number of states of the first factor if A is a Kronecker product (A1 x A2), 0 for a full A
+		int kron_N2; ///< number of states of the second factor
+		std::vector<double> A1; ///< [kron_N1 x kron_N1] first factor of A
+		std::vector<double> A2; ///< [kron_N2 x kron_N2] second factor of A
+		std::vector<double> A1k; ///< A1 with rows of AlignedLength(kron_N1) and zero padding, for the kernels
+		std::vector<double> A1tk; ///< transpose of A1 with padded rows
+		std::vector<double> A2k; ///< A2 with rows of AlignedLength(kron_N2) and zero padding
+		std::vector<double> A2tk; ///< transpose of A2 with padded rows
+		std::vector<double> sumxi1; ///< [kron_N1 x kron_N1] xi values summed over the states of the second factor
+		std::vector<double> sumxi2; ///< [kron_N2 x kron_N2] xi values summed over the states of the first factor
+		MatVecKernel matvec; ///< matrix-vector kernel for forward() and backward(), selected at runtime
+		MaxVecKernel maxvec; ///< max-product kernel with argmax for viterbi(), selected at runtime
 		double* proba; ///< initial probabilities (length N)
 		double* scalefactoralpha; ///< vector[T] of scaling factors
-		double** scalealpha; ///< matrix [T x N] of forward probabilities
-		double** scalebeta; ///<  matrix [T x N] of backward probabilities
-		double** densities; ///< matrix [N x T] of density values
+		MatrixLayout layout; ///< memory layout of scalealpha
+		MemoryMode memory; ///< MEMORY_LOW stores scalealpha only at checkpoints
+		int checkpoint_interval; ///< number of time points between two checkpoints (1 if all time points are stored)
+		int tstride; ///< distance between two consecutive time points (checkpoints) in scalealpha
+		int nstride; ///< distance between two consecutive states in scalealpha
+		double* scalealpha; ///< contiguous [T x N] block of forward probabilities (one row per checkpoint in MEMORY_LOW), access with alpha(t,iN)
+		size_t scalealpha_capacity; ///< number of doubles allocated for scalealpha
+		double* alphablock; ///< [checkpoint_interval x N] forward probabilities of one block per thread, recomputed in backward() for MEMORY_LOW
+		size_t alphablock_capacity; ///< number of doubles allocated for alphablock
+		std::vector<int> alphablock_start; ///< first time point in the block of each thread, -1 if it has to be recomputed
+		int num_segments; ///< number of independent chains (e.g. chromosomes)
+		std::vector<int> segment_start; ///< vector[num_segments+1], segment s spans the time points segment_start[s] to segment_start[s+1]-1
+		std::vector<int> segment_checkpoint; ///< row of the first checkpoint of each segment in scalealpha
+		int* obs; ///< vector [T] of observations (univariate only)
+		int max_obs; ///< maximum observation (univariate only)
+		double** densities; ///< univariate: matrix [max_obs+1 x N] of density values per read count, access with densities_at(t, block)
 // 		double** tdensities; ///< matrix [T x N] of density values, for use in multivariate !increases speed, but on cost of RAM usage and that seems to be limiting
 		time_t EMStartTime_sec; ///< start time of the EM in sec
 		int EMTime_real; ///< elapsed time from start of the 0th iteration
+		int EMiteration; ///< number of EM iterations done so far
 		int sumdiff_state_last; ///< sum of the difference in the state 1 assignments from one iteration to the next
-		double sumdiff_posterior; ///< sum of the difference in posterior (gamma) values from one iteration to the next
+		double sumdiff_posterior; ///< sum of the difference in posterior (gamma) values from one iteration to the next, only if posterior_diff
+		bool posterior_diff; ///< backward() compares each new posterior with the one it overwrites
 // 		bool use_tdens; ///< switch for using the tdensities in the calculations
 		whichvariate xvariate; ///< enum which stores if UNIVARIATE or MULTIVARIATE
+		bool quiet; ///< no console output, R's print functions must only be called from the main R thread
+		bool interruptible; ///< check for user interrupts, R_CheckUserInterrupt() must only be called from the main R thread
+		bool accelerate; ///< extrapolate the parameters after every second EM update (SQUAREM)
+		int iteration_limit; ///< limit of all rounds of the EM, only if has_iteration_limit
+		bool has_iteration_limit; ///< the EM runs in rounds, see set_iteration_limit()
+		int squarem_phase; ///< number of EM updates in the current extrapolation cycle
+		bool squarem_pending; ///< the parameters are extrapolated and the next Baum-Welch has to reach squarem_logP
+		double squarem_logP; ///< loglikelihood that the extrapolated parameters have to reach
+		double squarem_alpha; ///< step length of the last extrapolation
+		double squarem_stepmax; ///< maximum step length of the extrapolation
+		std::vector<double> squarem_theta0; ///< transformed parameters at the start of the extrapolation cycle
+		std::vector<double> squarem_theta2; ///< transformed parameters after two EM updates, used if the extrapolation fails
+		std::vector<int> viterbi_path; ///< vector[T] of state indices from viterbi()
+		double viterbi_logP; ///< joint log-probability of the observations and viterbi_path
+		std::vector<int> run_start; ///< first time point of each run of identical observations that is stepped over with matrix powers (univariate only)
+		std::vector<int> run_end; ///< last time point of each run
+		std::vector<int> run_value; ///< index of the observation of each run in run_powers
+		std::vector<int> segment_run; ///< vector[num_segments+1], the runs of segment s are segment_run[s] to segment_run[s+1]-1
+		int run_levels; ///< number of precomputed powers per observation
+		std::vector<double> run_powers; ///< [values x run_levels x N x ld] powers M^(2^j) of M = A*diag(densities) for the observations of the runs, each scaled to a maximum of 1
+		std::vector<double> run_power_logscale; ///< [values x run_levels] log of the scaling of each power
+		std::vector<double> run_beta; ///< [runs x ld] scaled backward variables at the end of each run, used by expand_runs()
+		bool runs_lumped; ///< gamma at the start of each run holds the sum of the posteriors up to the second last time point of the run, the other time points of the run are 0
 
 		// Methods
-		void forward(); ///< calculate forward variables (alpha)
-		void backward(); ///< calculate backward variables (beta)
-		void calc_sumgamma();
-		void calc_sumxi();
+		void allocate_forward_backward(MatrixLayout layout, MemoryMode memory);
+		void free_forward_backward();
+		inline double& alpha(int t, int iN) { return this->scalealpha[(size_t)t*this->tstride + (size_t)iN*this->nstride]; }
+		inline const double* densities_at(int t, DensityBlock& block) ///< densities of all states at time point t, multivariate densities are read through block
+		{
+			if (this->xvariate == UNIVARIATE)
+			{
+				return this->densities[this->obs[t]];
+			}
+			int offset = t % DENSITY_BLOCK;
+			if (t - offset != block.start)
+			{
+				this->gather_densities(t - offset, block);
+			}
+			return &block.values[(size_t)offset * this->N];
+		}
+		void gather_densities(int tstart, DensityBlock& block); ///< copy the multivariate densities of the block of time points from tstart on into block
+		inline void check_interrupt() { if (this->interruptible) { R_CheckUserInterrupt(); } }
+		void forward(); ///< calculate forward variables (alpha) for all segments
+		void forward_segment(int s);
+		void backward(); ///< calculate backward variables (beta) and in the same sweep gamma, sumgamma and sumxi for all segments
+		void backward_segment(int s, double* sumxi_s, double* sumgamma_s, double* sumdiff_s);
+		template<typename Backpointer> double viterbi_segment(int s); ///< decode segment s into viterbi_path and return its log-probability, one Backpointer per state and time point
+		void reserve_alpha_blocks(); ///< allocate one block of alphablock per thread of the following parallel region
+		void recompute_alpha_block(int s, int tstart, int tend); ///< recompute forward variables of segment s from the checkpoint at tstart into the block of the calling thread
+		void get_alpha(int s, int t, double* alpha_t); ///< copy the forward variables of time point t, recomputing the block if necessary
+		void update_transposed_A();
+		void transition_forward(const double* alpha, double* helpsum, double* scratch); ///< helpsum[iN] = sum_jN alpha[jN] * A[jN][iN], scratch has room for N values
+		void transition_backward(const double* densbeta, double* beta, double* scratch); ///< beta[iN] = sum_jN A[iN][jN] * densbeta[jN], scratch has room for N values
+		void accumulate_kronecker_xi(const double* alpha_t, const double* densbeta, double* sumxi1_s, double* sumxi2_s, double* scratch); ///< add the xi values of one time point, summed over the other factor, to sumxi1_s and sumxi2_s
+		void multiply_factors(); ///< A = A1 x A2
+		bool prune_states(); ///< drop the states below prune_threshold, true if the active states changed
+		void set_active_states(const std::vector<int>& states); ///< compact A, proba and densities to the given original states, their parameters are taken from the last time they were active
+		inline size_t scratch_size() { return (this->kron_N1 > 0) ? 2*(size_t)this->N + 2*(size_t)this->kron_N1*AlignedLength(this->kron_N2) + 2*(size_t)this->kron_N2*AlignedLength(this->kron_N1) + AlignedLength(this->kron_N1) + AlignedLength(this->kron_N2) : 1; } ///< number of values transition_forward(), transition_backward() and accumulate_kronecker_xi() need as scratch
+		void find_runs(); ///< runs of identical observations that are long enough to be stepped over with matrix powers
+		void calc_run_powers(); ///< precompute the powers of A*diag(densities) for the observations of the runs
+		double jump_alpha(int r, double* alpha); ///< forward variables from the start to the end of run r, returns the log of the product of the scaling factors
+		void jump_beta(int r, const double* alpha_start, double* beta, double* sumxi_s, double* sumgamma_run); ///< backward variables from the end to the start of run r and the sums of xi and gamma over the run
+		void expand_runs(); ///< replace the summed posteriors of the runs by the posteriors of each time point
+		void EM(int* maxiter, int* maxtime, double* eps, bool resume);
+		void update_parameters(); ///< update proba, A and the densities from gamma, sumgamma and sumxi
+		void next_parameters(int iteration, int maxiter); ///< parameter update after the Baum-Welch of the given iteration, followed by pruning or a SQUAREM step
+		void get_parameters(std::vector<double>& theta); ///< proba, A and the density parameters, transformed (log, logit) so that every real vector is valid
+		bool set_parameters(const std::vector<double>& theta); ///< inverse of get_parameters(), false if a parameter is not finite
+		void extrapolate_parameters(const std::vector<double>& theta1, double logP1); ///< SQUAREM step from the parameters theta1 of the last Baum-Welch and the current (updated) parameters
 		void calc_loglikelihood();
+		EmissionLayout get_emission_layout();
 		void calc_densities();
+		void calc_densities_generic();
+		template<bool HasZeroInflation, bool HasGeometric> void calc_densities_tied(); ///< fill the density table row by row for the layout of findCNVs()
+		void correct_zero_densities();
+		void update_densities();
+		void update_densities_generic();
+		template<bool HasZeroInflation, bool HasGeometric> void update_densities_tied(); ///< update the densities of the layout of findCNVs() from one pass over the posteriors
 		void print_uni_iteration(int iteration);
 		void print_multi_iteration(int iteration);
 		void print_uni_params();
@@ -2,8 +2,53 @@
 
 
 #include "utility.h"
+#include <Rmath.h> // digamma(), trigamma()
 
 /* helpers for memory management */
+// Number of doubles that fill one cache line
+#define DOUBLES_PER_CACHELINE 8
+
+// Round n up to a multiple of DOUBLES_PER_CACHELINE, so that consecutive rows of a matrix stay 64-byte aligned
+int AlignedLength(int n)
+{
+	return( ((n + DOUBLES_PER_CACHELINE - 1) / DOUBLES_PER_CACHELINE) * DOUBLES_PER_CACHELINE );
+}
+
+// Allocate n zeroed doubles starting on a 64-byte boundary. The pointer returned by Calloc() is stored right in front of the aligned block.
+double* CallocAlignedDouble(size_t n)
+{
+	size_t alignment = DOUBLES_PER_CACHELINE * sizeof(double);
+	char* raw = (char*) Calloc(n*sizeof(double) + alignment + sizeof(void*), char);
+	uintptr_t aligned = ((uintptr_t)(raw + sizeof(void*)) + alignment - 1) & ~((uintptr_t)(alignment - 1));
+	((void**) aligned)[-1] = raw;
+	return((double*) aligned);
+}
+
+void FreeAlignedDouble(double* array)
+{
+	char* raw = (char*) ((void**) array)[-1];
+	Free(raw);
+}
+
+// Allocate a matrix as one contiguous, 64-byte aligned block. Rows are padded to AlignedLength(cols), the padding is zero.
+double** CallocAlignedDoubleMatrix(int rows, int cols)
+{
+	int ld = AlignedLength(cols);
+	double** matrix = (double**) Calloc(rows, double*);
+	double* block = CallocAlignedDouble((size_t)rows * ld);
+	for (int i=0; i<rows; i++)
+	{
+		matrix[i] = block + (size_t)i * ld;
+	}
+	return(matrix);
+}
+
+void FreeAlignedDoubleMatrix(double** matrix)
+{
+	FreeAlignedDouble(matrix[0]);
+	Free(matrix);
+}
+
 double** allocDoubleMatrix(int rows, int cols)
 {
 	double** matrix = (double**) calloc(rows, sizeof(double*));
@@ -242,3 +287,57 @@ double MaxDoubleMatrix(double** a, int N, int M)
 	}
 	return maximum;
 }
+
+/* tables of special functions at x, x+1, ..., x+n, built with recurrences */
+// Each step costs one addition instead of a full evaluation. The values are recomputed directly every SPECIAL_FUNCTION_ANCHOR steps,
+// so rounding errors accumulate over at most that many steps. Below 1, digamma and trigamma are dominated by the 1/x terms that the
+// recurrence subtracts again, so arguments below 1 are always evaluated directly.
+#define SPECIAL_FUNCTION_ANCHOR 64
+
+// lgamma(x+1) = lgamma(x) + log(x)
+void lgamma_table(double x, int n, double* table)
+{
+	for (int j=0; j<=n; j++)
+	{
+		if (j % SPECIAL_FUNCTION_ANCHOR == 0 || x+j-1 < 1)
+		{
+			table[j] = lgamma(x+j);
+		}
+		else
+		{
+			table[j] = table[j-1] + log(x+j-1);
+		}
+	}
+}
+
+// digamma(x+1) = digamma(x) + 1/x
+void digamma_table(double x, int n, double* table)
+{
+	for (int j=0; j<=n; j++)
+	{
+		if (j % SPECIAL_FUNCTION_ANCHOR == 0 || x+j-1 < 1)
+		{
+			table[j] = digamma(x+j);
+		}
+		else
+		{
+			table[j] = table[j-1] + 1.0/(x+j-1);
+		}
+	}
+}
+
+// trigamma(x+1) = trigamma(x) - 1/x^2
+void trigamma_table(double x, int n, double* table)
+{
+	for (int j=0; j<=n; j++)
+	{
+		if (j % SPECIAL_FUNCTION_ANCHOR == 0 || x+j-1 < 1)
+		{
+			table[j] = trigamma(x+j);
+		}
+		else
+		{
+			table[j] = table[j-1] - 1.0/((x+j-1)*(x+j-1));
+		}
+	}
+}
@@ -9,6 +9,7 @@
 #include <cmath>
 #include <R.h> // Calloc() etc.
 #include <algorithm> // max_element
+#include <stdint.h> // uintptr_t
 
 /* custom error handling class */
 // static statement to avoid 'multiple definition' errors
@@ -20,7 +21,18 @@ static class exception_nan: public std::exception
   }
 } nan_detected; // this line creates an object of this class
 
+/* memory layout of the [T x N] work matrices */
+enum MatrixLayout {TIME_MAJOR, STATE_MAJOR};
+
+/* MEMORY_LOW keeps the forward variables only at checkpoints and recomputes them block-wise in the backward sweep */
+enum MemoryMode {MEMORY_FULL, MEMORY_LOW};
+
 /* helpers for memory management */
+int AlignedLength(int n);
+double* CallocAlignedDouble(size_t n);
+void FreeAlignedDouble(double* array);
+double** CallocAlignedDoubleMatrix(int rows, int cols);
+void FreeAlignedDoubleMatrix(double** matrix);
 double** allocDoubleMatrix(int rows, int cols);
 void freeDoubleMatrix(double** matrix, int rows);
 double** CallocDoubleMatrix(int rows, int cols);
@@ -44,4 +56,9 @@ int MaxIntMatrix(int**, int N, int M);
 double MaxDoubleMatrix(double**, int N, int M);
 void printDoubleAsBinary(double someDouble);
 
+/* tables of special functions at x, x+1, ..., x+n, built with recurrences */
+void lgamma_table(double x, int n, double* table);
+void digamma_table(double x, int n, double* table);
+void trigamma_table(double x, int n, double* table);
+
 #endif // UTILITY_H